@@ -13,3 +13,6 @@ option ( ENABLE_THREAD_SANITIZER "enable thread sanitizer support" OFF )
 option ( ENABLE_UB_SANITIZER "enable undefined behavior sanitizer support" OFF )
 option ( ENABLE_CODE_COVERAGE "Whether to enable code coverage support" OFF )
 
+# tests
+option ( ENABLE_UNIT_TESTS "Build and run unit tests (requires CppUTest)" OFF )
+
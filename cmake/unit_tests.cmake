@@ -0,0 +1,33 @@
+# unit tests are CppUTest executables next to the code they test, one per
+# add_cpputest() call, and are run with ctest
+
+if ( ENABLE_UNIT_TESTS )
+    include ( FindPkgConfig )
+    pkg_search_module ( CPPUTEST REQUIRED cpputest )
+    enable_testing ()
+endif ( ENABLE_UNIT_TESTS )
+
+# add_cpputest ( testname [SOURCES ...] [LIBS ...] )
+#   builds testname from testname.cc plus SOURCES and adds it as a test
+function ( add_cpputest testname )
+    if ( ENABLE_UNIT_TESTS )
+        set ( multiValueArgs SOURCES LIBS )
+        cmake_parse_arguments ( TEST "" "" "${multiValueArgs}" ${ARGN} )
+
+        add_executable ( ${testname} ${testname}.cc ${TEST_SOURCES} )
+
+        target_include_directories (
+            ${testname} PRIVATE
+            ${SNORT3_INCLUDE_DIRS}
+            ${CPPUTEST_INCLUDE_DIRS}
+        )
+
+        target_link_libraries (
+            ${testname}
+            ${CPPUTEST_LDFLAGS}
+            ${TEST_LIBS}
+        )
+
+        add_test ( ${testname} ${testname} )
+    endif ( ENABLE_UNIT_TESTS )
+endfunction ( add_cpputest )
@@ -37,6 +37,9 @@ Optional Features:
                             enable thread sanitizer support
     --enable-ub-sanitizer
                             enable undefined behavior sanitizer support
+    --enable-unit-tests     build unit tests, run them with ctest
+    --enable-lowmem-benchmark
+                            build the lowmem ktrie_bench search benchmark
 "
 
 sourcedir="$( cd "$( dirname "$0" )" && pwd )"
@@ -119,6 +122,18 @@ while [ $# -ne 0 ]; do
         --disable-ub-sanitizer)
             append_cache_entry ENABLE_UB_SANITIZER  BOOL false
             ;;
+        --enable-unit-tests)
+            append_cache_entry ENABLE_UNIT_TESTS    BOOL true
+            ;;
+        --disable-unit-tests)
+            append_cache_entry ENABLE_UNIT_TESTS    BOOL false
+            ;;
+        --enable-lowmem-benchmark)
+            append_cache_entry ENABLE_LOWMEM_BENCHMARK  BOOL true
+            ;;
+        --disable-lowmem-benchmark)
+            append_cache_entry ENABLE_LOWMEM_BENCHMARK  BOOL false
+            ;;
         --build-type=*)
             if [ $optarg = "Debug" ] || [ $optarg = "Release" ] ||
             [ $optarg = "RelWithDebInfo" ] || [ $optarg = "MinSizeRel" ]; then
@@ -20,29 +20,42 @@
 
 #include <cassert>
 #include <cerrno>
+#include <cstring>
 
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
 #include <fstream>
+#include <memory>
+#include <mutex>
 #include <string>
-#include <unordered_set>
+#include <thread>
 #include <vector>
 
 #include "detection/detection_engine.h"
+#include "flow/flow.h"
 #include "framework/inspector.h"
 #include "framework/module.h"
 #include "log/messages.h"
 #include "main/thread.h"
 #include "profiler/profiler.h"
 #include "pub_sub/http_events.h"
+#include "pub_sub/ssl_events.h"
 #include "utils/util.h"
 
+#include "domain_table.h"
+
 #define DF_GID 175
 #define DF_SID   1
+#define DF_SID_SNI 2
+
+// longest domain and a trailing dot
+#define DF_MAX_HOST 254
 
 static const char* s_name = "domain_filter";
-static const char* s_help = "alert on configured HTTP domains";
+static const char* s_help = "alert on configured domains in HTTP hosts and TLS server names";
 
 using DomainList = std::vector<std::string>;
-using DomainSet = std::unordered_set<std::string>;
 using namespace snort;
 
 //--------------------------------------------------------------------------
@@ -57,12 +70,28 @@ static const Parameter s_params[] =
     { "hosts", Parameter::PT_STRING, nullptr, nullptr,
       "list of domains identifying hosts to be filtered" },
 
+    { "suffix", Parameter::PT_BOOL, nullptr, "false",
+      "also filter subdomains of plain domains; .domain and *.domain always do" },
+
+    { "image", Parameter::PT_STRING, nullptr, nullptr,
+      "compiled form of file, mapped instead of reading file and rebuilt when file changes" },
+
+    { "refresh", Parameter::PT_INT, "0:86400", "0",
+      "seconds between checks of file for changes, which are loaded without a reload; 0 to not check" },
+
+    { "sources", Parameter::PT_MULTI, "http | ssl", "http",
+      "where hosts are checked: HTTP request host, TLS client hello server name" },
+
+    { "prefilter", Parameter::PT_BOOL, nullptr, "false",
+      "check a compact filter of the hosts before the table; speeds up misses with large lists" },
+
     { nullptr, Parameter::PT_MAX, nullptr, nullptr, nullptr }
 };
 
 static const RuleMap s_rules[] =
 {
     { DF_SID, "configured domain detected" },
+    { DF_SID_SNI, "configured domain detected in TLS server name" },
 
     { 0, nullptr }
 };
@@ -71,6 +100,9 @@ struct DomainFilterStats
 {
     PegCount checked;
     PegCount filtered;
+    PegCount cache_hits;
+    PegCount cache_misses;
+    PegCount prefilter_rejects;
 };
 
 static THREAD_LOCAL DomainFilterStats s_counts;
@@ -79,12 +111,224 @@ const PegInfo s_pegs[] =
 {
     { CountType::SUM, "checked", "domains checked" },
     { CountType::SUM, "filtered", "domains filtered" },
+    { CountType::SUM, "cache_hits", "domains checked with the verdict cached for the flow" },
+    { CountType::SUM, "cache_misses", "domains checked against the table" },
+    { CountType::SUM, "prefilter_rejects", "domains ruled out by the prefilter without probing the table" },
 
     { CountType::END, nullptr, nullptr }
 };
 
 static THREAD_LOCAL ProfileStats s_prof;
 
+//--------------------------------------------------------------------------
+// table stuff
+//--------------------------------------------------------------------------
+
+// event sources checked
+#define DF_SOURCE_HTTP 0x01
+#define DF_SOURCE_SSL  0x02
+
+// where the hosts come from, kept by the inspector to reload them
+struct DomainConfig
+{
+    DomainList hosts;
+    std::string file;
+    std::string image;
+    unsigned refresh = 0;
+    unsigned sources = DF_SOURCE_HTTP;
+    bool suffix = false;
+    bool prefilter = false;
+};
+
+// invalid entries are skipped so one bad line in a large feed doesn't
+// keep the rest out; the count and first one are given in warning
+static bool read_file(
+    const std::string& file, DomainList& list, std::string& error, std::string& warning)
+{
+    std::ifstream df(file);
+
+    if ( !df.is_open() )
+    {
+        error = "can't open file " + file + ": " + get_error(errno);
+        return false;
+    }
+    std::string tok, first;
+    unsigned skipped = 0;
+
+    while ( df >> tok )
+    {
+        if ( DomainTable::valid(tok) )
+            list.push_back(tok);
+
+        else if ( !skipped++ )
+            first = tok;
+    }
+
+    if ( skipped )
+    {
+        warning = "skipped " + std::to_string(skipped) + " invalid domains in file " +
+            file + ", the first is " + first;
+    }
+    return true;
+}
+
+static DomainTable* finish_table(const DomainConfig& c, std::unique_ptr<DomainTable>& t)
+{
+    if ( c.prefilter )
+        t->add_prefilter();
+
+    return t.release();
+}
+
+// the image is mapped if it is current, else the file is read and the
+// image rebuilt; if that fails the file is used as is.  either is noted
+// in warning, as are invalid entries skipped in the file.  stamp is that
+// of the file as of when it was read.
+static DomainTable* load_table(
+    const DomainConfig& c, uint64_t& stamp, std::string& error, std::string& warning)
+{
+    std::unique_ptr<DomainTable> t(new DomainTable(c.suffix));
+    stamp = 0;
+
+    // entries were checked by the module
+    for ( const auto& s : c.hosts )
+        t->add(s);
+
+    if ( c.file.empty() )
+    {
+        if ( !c.image.empty() and !t->load(c.image.c_str(), 0) )
+        {
+            error = "can't load image " + c.image;
+            return nullptr;
+        }
+        return finish_table(c, t);
+    }
+
+    if ( !t->get_stamp(c.file.c_str(), stamp) )
+    {
+        error = "can't open file " + c.file + ": " + get_error(errno);
+        return nullptr;
+    }
+
+    if ( !c.image.empty() and t->load(c.image.c_str(), stamp) )
+        return finish_table(c, t);
+
+    DomainList list;
+
+    if ( !read_file(c.file, list, error, warning) )
+        return nullptr;
+
+    if ( !c.image.empty() )
+    {
+        DomainTable ft(c.suffix);
+
+        for ( const auto& s : list )
+            ft.add(s);
+
+        if ( ft.save(c.image.c_str(), stamp) and t->load(c.image.c_str(), stamp) )
+            return finish_table(c, t);
+
+        if ( !warning.empty() )
+            warning += "; ";
+
+        warning += "can't build image " + c.image + ", using file " + c.file;
+    }
+
+    for ( const auto& s : list )
+        t->add(s);
+
+    return finish_table(c, t);
+}
+
+// The table in use is replaced as a whole when the file changes.  Each
+// replacement gets a new generation.  Packet threads hold a reference to
+// the table of the generation they last saw and switch at their next
+// lookup after a change, so the old table is released by the last thread
+// to move past it.  Each feed has its own slot in the thread's cache so
+// feeds of different policies or configurations don't evict each other;
+// slots are reused after their feed is deleted.
+
+static std::atomic<uint64_t> s_generation { 0 };
+
+struct FeedCache
+{
+    uint64_t gen = 0;
+    std::shared_ptr<const DomainTable> table;
+};
+
+static THREAD_LOCAL std::vector<FeedCache>* s_caches = nullptr;
+
+static std::mutex s_slot_mutex;
+static std::vector<unsigned> s_free_slots;
+static unsigned s_slots = 0;
+
+static unsigned get_slot()
+{
+    std::lock_guard<std::mutex> lock(s_slot_mutex);
+
+    if ( s_free_slots.empty() )
+        return s_slots++;
+
+    unsigned slot = s_free_slots.back();
+    s_free_slots.pop_back();
+    return slot;
+}
+
+static void put_slot(unsigned slot)
+{
+    std::lock_guard<std::mutex> lock(s_slot_mutex);
+    s_free_slots.push_back(slot);
+}
+
+class DomainFeed
+{
+public:
+    DomainFeed(DomainTable* t) : slot(get_slot())
+    { publish(t); }
+
+    ~DomainFeed()
+    { put_slot(slot); }
+
+    DomainFeed(const DomainFeed&) = delete;
+    DomainFeed& operator=(const DomainFeed&) = delete;
+
+    // for packet threads; g is the generation of the table returned.
+    // generations are unique across feeds so a reused slot just misses.
+    const DomainTable* get(uint64_t& g) const
+    {
+        g = gen.load(std::memory_order_acquire);
+
+        if ( !s_caches )
+            s_caches = new std::vector<FeedCache>;
+
+        if ( slot >= s_caches->size() )
+            s_caches->resize(slot + 1);
+
+        FeedCache& c = (*s_caches)[slot];
+
+        if ( c.gen != g )
+        {
+            c.table = std::atomic_load(&table);
+            c.gen = g;
+        }
+        return c.table.get();
+    }
+
+    std::shared_ptr<const DomainTable> get_shared() const
+    { return std::atomic_load(&table); }
+
+    void publish(DomainTable* t)
+    {
+        std::atomic_store(&table, std::shared_ptr<const DomainTable>(t));
+        gen.store(++s_generation, std::memory_order_release);
+    }
+
+private:
+    std::shared_ptr<const DomainTable> table;
+    std::atomic<uint64_t> gen { 0 };
+    unsigned slot;
+};
+
 //--------------------------------------------------------------------------
 // module stuff
 //--------------------------------------------------------------------------
@@ -93,11 +337,17 @@ class DomainFilterModule : public Module
 {
 public:
     DomainFilterModule() : Module(s_name, s_help, s_params) { }
+    ~DomainFilterModule() override;
+
+    const DomainConfig& get_config() const
+    { return config; }
 
-    DomainList& get_hosts()
-    { return hosts; }
+    // the inspector takes the table
+    DomainTable* get_table(uint64_t& stamp);
 
+    bool begin(const char*, int, SnortConfig*) override;
     bool set(const char*, Value&, SnortConfig*) override;
+    bool end(const char*, int, SnortConfig*) override;
 
     const PegInfo* get_pegs() const override
     { return s_pegs; }
@@ -117,37 +367,191 @@ public:
     ProfileStats* get_profile() const override
     { return &s_prof; }
 
-public:
-    DomainList hosts;
+private:
+    DomainConfig config;
+    DomainTable* table = nullptr;
+    uint64_t stamp = 0;
 };
 
+DomainFilterModule::~DomainFilterModule()
+{ delete table; }
+
+DomainTable* DomainFilterModule::get_table(uint64_t& s)
+{
+    DomainTable* t = table ? table : new DomainTable(config.suffix);
+    table = nullptr;
+    s = stamp;
+    return t;
+}
+
+bool DomainFilterModule::begin(const char*, int, SnortConfig*)
+{
+    config = DomainConfig();
+    return true;
+}
+
 bool DomainFilterModule::set(const char*, Value& v, SnortConfig*)
 {
     if ( v.is("file") )
+        config.file = v.get_string();
+
+    else if ( v.is("hosts") )
     {
-        std::ifstream df(v.get_string());
+        std::string tok;
+        v.set_first_token();
 
-        if ( !df.is_open() )
+        while ( v.get_next_token(tok) )
         {
-            ParseError("can't open file %s: %s", v.get_string(), get_error(errno));
-            return false;
+            if ( DomainTable::valid(tok) )
+                config.hosts.push_back(tok);
+            else
+                ParseError("invalid domain %s", tok.c_str());
         }
-        std::string tok;
-
-        while ( df >> tok )
-            hosts.push_back(tok);
     }
-    else if ( v.is("hosts") )
+    else if ( v.is("suffix") )
+        config.suffix = v.get_bool();
+
+    else if ( v.is("prefilter") )
+        config.prefilter = v.get_bool();
+
+    else if ( v.is("image") )
+        config.image = v.get_string();
+
+    else if ( v.is("refresh") )
+        config.refresh = v.get_uint32();
+
+    else if ( v.is("sources") )
     {
         std::string tok;
         v.set_first_token();
+        config.sources = 0;
 
         while ( v.get_next_token(tok) )
-            hosts.push_back(tok);
+        {
+            if ( tok == "http" )
+                config.sources |= DF_SOURCE_HTTP;
+
+            else if ( tok == "ssl" )
+                config.sources |= DF_SOURCE_SSL;
+        }
     }
+
     return true;
 }
 
+bool DomainFilterModule::end(const char*, int, SnortConfig*)
+{
+    std::string error, warning;
+
+    delete table;
+    table = load_table(config, stamp, error, warning);
+
+    if ( !warning.empty() )
+        ParseWarning(WARN_CONF, "%s", warning.c_str());
+
+    if ( !table )
+    {
+        ParseError("%s", error.c_str());
+        return false;
+    }
+    return true;
+}
+
+//--------------------------------------------------------------------------
+// flow data stuff
+//--------------------------------------------------------------------------
+
+// the last host checked on the flow and its verdict
+class DomainFlowData : public FlowData
+{
+public:
+    DomainFlowData() : FlowData(data_id) { }
+
+    static void init()
+    { data_id = FlowData::create_flow_data_id(); }
+
+public:
+    static unsigned data_id;
+
+    uint64_t gen = 0;       // of the table that gave the verdict
+    uint64_t hash = 0;      // of the host
+    unsigned len = 0;
+    bool filtered = false;
+    char host[DF_MAX_HOST]; // case folded
+};
+
+unsigned DomainFlowData::data_id = 0;
+
+static inline char fold(char c)
+{ return (c >= 'A' and c <= 'Z') ? c + ('a' - 'A') : c; }
+
+static bool same_host(const DomainFlowData* fd, const char* s, unsigned len)
+{
+    char host[DF_MAX_HOST];
+
+    for ( unsigned i = 0; i < len; i++ )
+        host[i] = fold(s[i]);
+
+    return !memcmp(fd->host, host, len);
+}
+
+// Hosts rarely change on a flow so a repeat is found by its length and
+// hash and confirmed by its bytes, since the hash is easily collided,
+// before it gets the cached verdict without probing the table.  A new
+// table invalidates the cache.  Hosts too long to be domains aren't
+// cached.
+static bool check_host(const DomainFeed& feed, Flow* flow, const char* s, unsigned len)
+{
+    uint64_t gen;
+    const DomainTable* table = feed.get(gen);
+    uint64_t hash = DomainTable::hash(s, len);
+
+    DomainFlowData* fd = flow ?
+        (DomainFlowData*)flow->get_flow_data(DomainFlowData::data_id) : nullptr;
+
+    if ( fd and fd->gen == gen and fd->len == len and fd->hash == hash and
+        same_host(fd, s, len) )
+    {
+        ++s_counts.cache_hits;
+        return fd->filtered;
+    }
+    ++s_counts.cache_misses;
+
+    bool rejected;
+    bool filtered = table->match(s, len, &rejected);
+
+    if ( rejected )
+        ++s_counts.prefilter_rejects;
+
+    if ( flow and len <= DF_MAX_HOST )
+    {
+        if ( !fd )
+        {
+            fd = new DomainFlowData;
+            flow->set_flow_data(fd);
+        }
+        fd->gen = gen;
+        fd->hash = hash;
+        fd->len = len;
+        fd->filtered = filtered;
+
+        for ( unsigned i = 0; i < len; i++ )
+            fd->host[i] = fold(s[i]);
+    }
+    return filtered;
+}
+
+// all sources share the table, the flow cache and the pegs
+static void filter_host(const DomainFeed& feed, Flow* flow, const char* s, unsigned len, unsigned sid)
+{
+    if ( check_host(feed, flow, s, len) )
+    {
+        DetectionEngine::queue_event(DF_GID, sid);
+        ++s_counts.filtered;
+    }
+    ++s_counts.checked;
+}
+
 //--------------------------------------------------------------------------
 // event stuff
 //--------------------------------------------------------------------------
@@ -155,15 +559,15 @@ bool DomainFilterModule::set(const char*, Value& v, SnortConfig*)
 class HttpHandler : public DataHandler
 {
 public:
-    HttpHandler(DomainSet& sv) : DataHandler(s_name), hosts(sv) { }
+    HttpHandler(const DomainFeed& f) : DataHandler(s_name), hosts(f) { }
 
     void handle(DataEvent& e, Flow*) override;
 
 private:
-    DomainSet& hosts;
+    const DomainFeed& hosts;
 };
 
-void HttpHandler::handle(DataEvent& de, Flow*)
+void HttpHandler::handle(DataEvent& de, Flow* flow)
 {
     Profile profile(s_prof);    // cppcheck-suppress unreadVariable
     HttpEvent* he = (HttpEvent*)&de;
@@ -174,17 +578,31 @@ void HttpHandler::handle(DataEvent& de, Flow*)
     if ( !s or len < 1 )
         return;
 
-    std::string h(s, len);
-    transform(h.begin(), h.end(), h.begin(), ::tolower);
+    filter_host(hosts, flow, s, len, DF_SID);
+}
 
-    DomainSet::const_iterator it = hosts.find(h);
+class SslHandler : public DataHandler
+{
+public:
+    SslHandler(const DomainFeed& f) : DataHandler(s_name), hosts(f) { }
 
-    if ( it != hosts.end() )
-    {
-        DetectionEngine::queue_event(DF_GID, DF_SID);
-        ++s_counts.filtered;
-    }
-    ++s_counts.checked;
+    void handle(DataEvent& e, Flow*) override;
+
+private:
+    const DomainFeed& hosts;
+};
+
+void SslHandler::handle(DataEvent& de, Flow* flow)
+{
+    Profile profile(s_prof);    // cppcheck-suppress unreadVariable
+    SslClientHelloEvent* se = (SslClientHelloEvent*)&de;
+
+    const std::string& host = se->get_host_name();
+
+    if ( host.empty() )
+        return;
+
+    filter_host(hosts, flow, host.data(), host.size(), DF_SID_SNI);
 }
 
 //--------------------------------------------------------------------------
@@ -194,37 +612,114 @@ void HttpHandler::handle(DataEvent& de, Flow*)
 class DomainFilter : public Inspector
 {
 public:
-    DomainFilter(DomainList&);
+    DomainFilter(const DomainConfig& c, DomainTable* t, uint64_t s) :
+        config(c), hosts(t), stamp(s) { }
+
+    ~DomainFilter() override;
 
     bool configure(SnortConfig*) override;
     void show(const SnortConfig*) const override;
     void eval(Packet*) override { }
 
+    // load the file if it changed; the watcher calls this every refresh
+    // seconds
+    void refresh();
+
 private:
-    DomainSet hosts;
+    bool watching() const
+    { return config.refresh and !config.file.empty(); }
+
+    void watch();
+
+private:
+    DomainConfig config;
+    DomainFeed hosts;
+    uint64_t stamp;     // of the file when the current table was loaded
+
+    std::thread watcher;
+    std::mutex watch_mutex;
+    std::condition_variable watch_cond;
+    bool stopping = false;
 };
 
-DomainFilter::DomainFilter(DomainList& sv)
+DomainFilter::~DomainFilter()
 {
-    hosts.insert(sv.begin(), sv.end());
-    sv.clear();
+    if ( !watcher.joinable() )
+        return;
+
+    {
+        std::lock_guard<std::mutex> lock(watch_mutex);
+        stopping = true;
+    }
+    watch_cond.notify_one();
+    watcher.join();
 }
 
 bool DomainFilter::configure(SnortConfig*)
 {
-    if ( !hosts.empty() )
+    if ( hosts.get_shared()->empty() and !watching() )
+        return true;
+
+    if ( config.sources & DF_SOURCE_HTTP )
         DataBus::subscribe(http_pub_key, HttpEventIds::REQUEST_HEADER, new HttpHandler(hosts));
 
+    if ( config.sources & DF_SOURCE_SSL )
+        DataBus::subscribe(ssl_pub_key, SslEventIds::CHELLO_SERVER_NAME, new SslHandler(hosts));
+
+    if ( watching() )
+        watcher = std::thread(&DomainFilter::watch, this);
+
     return true;
 }
 
+void DomainFilter::watch()
+{
+    std::unique_lock<std::mutex> lock(watch_mutex);
+
+    while ( !watch_cond.wait_for(
+        lock, std::chrono::seconds(config.refresh), [this]() { return stopping; }) )
+    {
+        lock.unlock();
+        refresh();
+        lock.lock();
+    }
+}
+
+// runs on the watcher thread, off the packet path
+void DomainFilter::refresh()
+{
+    uint64_t now;
+
+    if ( !hosts.get_shared()->get_stamp(config.file.c_str(), now) or now == stamp )
+        return;
+
+    std::string error, warning;
+    uint64_t loaded;
+    DomainTable* t = load_table(config, loaded, error, warning);
+
+    if ( !warning.empty() )
+        WarningMessage("%s: %s\n", s_name, warning.c_str());
+
+    if ( !t )
+    {
+        // keep the current table until the file changes again
+        WarningMessage("%s: %s, keeping the current hosts\n", s_name, error.c_str());
+        stamp = now;
+        return;
+    }
+
+    stamp = loaded;
+    hosts.publish(t);
+
+    LogMessage("%s: loaded %zu hosts from %s\n", s_name, t->size(), config.file.c_str());
+}
+
 void DomainFilter::show(const SnortConfig*) const
 {
-    DomainList domain_list;
-    domain_list.reserve(hosts.size());
+    std::shared_ptr<const DomainTable> table = hosts.get_shared();
 
-    std::copy(hosts.begin(), hosts.end(), std::back_inserter(domain_list));
-    std::sort(domain_list.begin(), domain_list.end());
+    DomainList domain_list;
+    table->get_entries(domain_list);
 
     std::string sorted_hosts;
     for (const auto& host : domain_list)
@@ -238,6 +733,30 @@ void DomainFilter::show(const SnortConfig*) const
         sorted_hosts = "none";
 
     ConfigLogger::log_list("hosts", sorted_hosts.c_str());
+    ConfigLogger::log_flag("suffix", table->get_suffix());
+    ConfigLogger::log_flag("prefilter", table->has_prefilter());
+
+    if ( !table->get_image().empty() )
+    {
+        ConfigLogger::log_value("image", table->get_image().c_str());
+        ConfigLogger::log_value("image_hosts", table->image_size());
+    }
+    ConfigLogger::log_value("refresh", config.refresh);
+
+    std::string sources;
+
+    if ( config.sources & DF_SOURCE_HTTP )
+        sources += "http ";
+
+    if ( config.sources & DF_SOURCE_SSL )
+        sources += "ssl ";
+
+    if ( sources.empty() )
+        sources = "none";
+    else
+        sources.pop_back();
+
+    ConfigLogger::log_value("sources", sources.c_str());
 }
 
 //--------------------------------------------------------------------------
@@ -253,7 +772,9 @@ static void mod_dtor(Module* pm)
 static Inspector* df_ctor(Module* m)
 {
     DomainFilterModule* pm = (DomainFilterModule*)m;
-    return new DomainFilter(pm->get_hosts());
+    uint64_t stamp;
+    DomainTable* t = pm->get_table(stamp);
+    return new DomainFilter(pm->get_config(), t, stamp);
 }
 
 static void df_dtor(Inspector* p)
@@ -262,6 +783,16 @@ static void df_dtor(Inspector* p)
     delete p;
 }
 
+static void df_init()
+{ DomainFlowData::init(); }
+
+static void df_tterm()
+{
+    // release the tables this thread last used
+    delete s_caches;
+    s_caches = nullptr;
+}
+
 static const InspectApi df_api =
 {
     {
@@ -281,10 +812,10 @@ static const InspectApi df_api =
     0,        // proto_bits;
     nullptr,  // buffers
     nullptr,  // service
-    nullptr,  // pinit
+    df_init,  // pinit
     nullptr,  // pterm
     nullptr,  // tinit
-    nullptr,  // tterm
+    df_tterm, // tterm
 
     df_ctor,
     df_dtor,
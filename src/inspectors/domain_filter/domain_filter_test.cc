@@ -18,24 +18,29 @@
 
 // domain_filter_test.cc author Russ Combs <rucombs@cisco.com>
 
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
+#include <initializer_list>
 #include <string>
 #include <sstream>
 
 #include "detection/detection_engine.h"
+#include "flow/flow.h"
 #include "framework/data_bus.h"
 #include "framework/inspector.h"
 #include "framework/module.h"
+#include "log/messages.h"
 #include "profiler/memory_profiler_defs.h"
 #include "pub_sub/http_events.h"
+#include "pub_sub/ssl_events.h"
+
+#include "domain_filter.cc"
 
 #include <CppUTest/CommandLineTestRunner.h>
 #include <CppUTest/TestHarness.h>
 
-using namespace snort;
-extern const BaseApi* snort_plugins[];
-
 //--------------------------------------------------------------------------
 // clones
 //--------------------------------------------------------------------------
@@ -64,15 +69,19 @@ bool Value::get_next_token(std::string& tok)
 //--------------------------------------------------------------------------
 
 static DataHandler* s_handler = nullptr;
+static DataHandler* s_ssl_handler = nullptr;
 
-void DataBus::subscribe(char const*, DataHandler* dh)
+void DataBus::subscribe(const PubKey& key, unsigned, DataHandler* dh)
 {
-    s_handler = dh;
+    if ( !strcmp(key.publisher, ssl_pub_key.publisher) )
+        s_ssl_handler = dh;
+    else
+        s_handler = dh;
 }
 
 static const char* s_host = nullptr;
 
-const uint8_t* HttpEvent::get_host(int32_t& len)
+const uint8_t* HttpEvent::get_uri_host(int32_t& len)
 {
     len = s_host ? strlen(s_host) : 0;
     return (uint8_t*)s_host;
@@ -84,7 +93,7 @@ const uint8_t* HttpEvent::get_host(int32_t& len)
 
 static unsigned s_alerts = 0;
 
-int DetectionEngine::queue_event(unsigned, unsigned, uint8_t)
+int DetectionEngine::queue_event(unsigned, unsigned)
 {
     ++s_alerts;
     return 0;
@@ -133,6 +142,147 @@ MemoryContext::MemoryContext(MemoryTracker&) : saved(nullptr)
 { }
 MemoryContext::~MemoryContext() { }
 
+// tests use one flow at a time
+static FlowData* s_flow_data = nullptr;
+
+Flow::Flow() { }
+
+Flow::~Flow()
+{
+    delete s_flow_data;
+    s_flow_data = nullptr;
+}
+
+int Flow::set_flow_data(FlowData* fd)
+{
+    delete s_flow_data;
+    s_flow_data = fd;
+    return 0;
+}
+
+FlowData* Flow::get_flow_data(uint32_t) const
+{ return s_flow_data; }
+
+unsigned FlowData::flow_data_id = 0;
+
+FlowData::FlowData(unsigned, Inspector*) { }
+FlowData::~FlowData() { }
+
+namespace snort
+{
+const char* get_error(int) { return "error"; }
+
+void ParseError(const char*, ...) { }
+void ParseWarning(WarningGroup, const char*, ...) { }
+void LogMessage(const char*, ...) { }
+void WarningMessage(const char*, ...) { }
+
+bool ConfigLogger::log_flag(const char*, bool, bool) { return true; }
+void ConfigLogger::log_value(const char*, int64_t, bool) { }
+void ConfigLogger::log_value(const char*, const char*, bool) { }
+void ConfigLogger::log_list(const char*, const char*, const char*, bool) { }
+}
+
+//--------------------------------------------------------------------------
+// fixture
+//--------------------------------------------------------------------------
+
+struct Setting
+{
+    const char* name;
+    const char* value;  // "true" or "false" for bools
+};
+
+// a configured module and inspector with its handlers subscribed
+struct DomainFilterFixture
+{
+    const InspectApi* api = nullptr;
+    Inspector* ins = nullptr;
+    Module* mod = nullptr;
+
+    void set(const char* name, const char* value)
+    {
+        const Parameter* p = mod->get_parameters();
+
+        while ( p->name and strcmp(p->name, name) )
+            ++p;
+
+        CHECK(p->name != nullptr);
+
+        if ( p->type == Parameter::PT_BOOL )
+        {
+            Value v(!strcmp(value, "true"));
+            v.set(p);
+            CHECK(mod->set(nullptr, v, nullptr));
+        }
+        else if ( p->type == Parameter::PT_INT )
+        {
+            Value v((double)strtoul(value, nullptr, 0));
+            v.set(p);
+            CHECK(mod->set(nullptr, v, nullptr));
+        }
+        else
+        {
+            Value v(value);
+            v.set(p);
+            CHECK(mod->set(nullptr, v, nullptr));
+        }
+    }
+
+    // hosts may be null when the settings give a file
+    void start(const char* hosts, std::initializer_list<Setting> settings = { })
+    {
+        CHECK(snort_plugins[0] != nullptr);
+        CHECK(snort_plugins[0]->type == PT_INSPECTOR);
+        api = (const InspectApi*)snort_plugins[0];
+
+        mod = api->base.mod_ctor();
+        CHECK(mod != nullptr);
+        CHECK(mod->begin(nullptr, 0, nullptr));
+
+        if ( hosts )
+            set("hosts", hosts);
+
+        for ( const auto& s : settings )
+            set(s.name, s.value);
+
+        CHECK(mod->end(nullptr, 0, nullptr));
+
+        ins = api->ctor(mod);
+        CHECK(ins != nullptr);
+        CHECK(ins->configure(nullptr));
+
+        CHECK(s_handler != nullptr);
+
+        for ( unsigned i = 0; mod->get_pegs()[i].name; i++ )
+            mod->get_counts()[i] = 0;
+    }
+
+    void stop()
+    {
+        // as a packet thread would before the inspector goes away
+        api->tterm();
+
+        api->dtor(ins);
+        api->base.mod_dtor(mod);
+        ins = nullptr;
+        mod = nullptr;
+
+        delete s_handler;
+        s_handler = nullptr;
+        delete s_ssl_handler;
+        s_ssl_handler = nullptr;
+        s_alerts = 0;
+    }
+
+    void check_host(const char* host, Flow* flow = nullptr)
+    {
+        HttpEvent he(nullptr);
+        s_host = host;
+        s_handler->handle(he, flow);
+    }
+};
+
 //--------------------------------------------------------------------------
 
 TEST_GROUP(domain_filter_base)
@@ -191,7 +341,8 @@ TEST(domain_filter_ins, module)
     CHECK(mod->get_gid() == 175);
 
     CHECK(mod->get_parameters() != nullptr);
-    CHECK(!strcmp(mod->get_parameters()->name, "hosts"));
+    CHECK(!strcmp(mod->get_parameters()[0].name, "file"));
+    CHECK(!strcmp(mod->get_parameters()[1].name, "hosts"));
 
     CHECK(mod->get_rules() != nullptr);
     CHECK(mod->get_rules()->msg != nullptr);
@@ -204,6 +355,9 @@ TEST(domain_filter_ins, module)
 
     CHECK(!strcmp(mod->get_pegs()[0].name, "checked"));
     CHECK(!strcmp(mod->get_pegs()[1].name, "filtered"));
+    CHECK(!strcmp(mod->get_pegs()[2].name, "cache_hits"));
+    CHECK(!strcmp(mod->get_pegs()[3].name, "cache_misses"));
+    CHECK(!strcmp(mod->get_pegs()[4].name, "prefilter_rejects"));
 
     api->base.mod_dtor(mod);
 }
@@ -225,84 +379,422 @@ TEST(domain_filter_ins, basic)
 
 TEST_GROUP(domain_filter_events)
 {
-    const InspectApi* api;
-    Inspector* ins; // cppcheck-suppress variableScope
-    Module* mod;    // cppcheck-suppress variableScope
+    DomainFilterFixture df;
+
+    void setup() override
+    { df.start("zombie.com\ntest.com apocalypse.com "); }
+
+    void teardown() override
+    { df.stop(); }
+};
+
+TEST(domain_filter_events, no_host)
+{
+    df.check_host(nullptr);
+    CHECK(s_alerts == 0);
+    CHECK(df.mod->get_counts()[0] == 0);
+    CHECK(df.mod->get_counts()[1] == 0);
+}
+
+TEST(domain_filter_events, no_alert)
+{
+    df.check_host("jest.com");
+    df.check_host("xtest.com");
+    df.check_host("test.co");
+    CHECK(s_alerts == 0);
+    CHECK(df.mod->get_counts()[0] == 3);
+    CHECK(df.mod->get_counts()[1] == 0);
+}
+
+TEST(domain_filter_events, one_alert)
+{
+    df.check_host("test.com");
+    CHECK(s_alerts == 1);
+    CHECK(df.mod->get_counts()[0] == 1);
+    CHECK(df.mod->get_counts()[1] == 1);
+}
+
+TEST(domain_filter_events, mixed_case_alert)
+{
+    df.check_host("TEST.com");
+    CHECK(s_alerts == 1);
+    CHECK(df.mod->get_counts()[0] == 1);
+    CHECK(df.mod->get_counts()[1] == 1);
+}
+
+//--------------------------------------------------------------------------
+
+TEST_GROUP(domain_filter_suffix)
+{
+    DomainFilterFixture df;
 
     void setup() override
+    { df.start("zombie.com .test.com *.apocalypse.com"); }
+
+    void teardown() override
+    { df.stop(); }
+};
+
+TEST(domain_filter_suffix, exact_only)
+{
+    df.check_host("zombie.com");
+    df.check_host("www.zombie.com");
+    CHECK(s_alerts == 1);
+    CHECK(df.mod->get_counts()[0] == 2);
+    CHECK(df.mod->get_counts()[1] == 1);
+}
+
+TEST(domain_filter_suffix, domain_and_subdomains)
+{
+    df.check_host("test.com");
+    df.check_host("a.b.TEST.com.");
+    df.check_host("atest.com");
+    CHECK(s_alerts == 2);
+    CHECK(df.mod->get_counts()[0] == 3);
+    CHECK(df.mod->get_counts()[1] == 2);
+}
+
+TEST(domain_filter_suffix, wildcard)
+{
+    df.check_host("apocalypse.com");
+    df.check_host("www.apocalypse.com");
+    CHECK(s_alerts == 1);
+    CHECK(df.mod->get_counts()[0] == 2);
+    CHECK(df.mod->get_counts()[1] == 1);
+}
+
+//--------------------------------------------------------------------------
+
+TEST_GROUP(domain_filter_flow)
+{
+    DomainFilterFixture df;
+
+    void setup() override
+    { df.start(".test.com"); }
+
+    void teardown() override
+    { df.stop(); }
+};
+
+TEST(domain_filter_flow, cached_verdict)
+{
+    Flow flow;
+    PegCount* pc = df.mod->get_counts();
+
+    df.check_host("www.test.com", &flow);
+    CHECK(pc[2] == 0);
+    CHECK(pc[3] == 1);
+
+    // same host, any case
+    df.check_host("WWW.test.com", &flow);
+    CHECK(pc[2] == 1);
+    CHECK(pc[3] == 1);
+    CHECK(s_alerts == 2);
+
+    // a new host replaces the cached one
+    df.check_host("www.jest.com", &flow);
+    CHECK(pc[2] == 1);
+    CHECK(pc[3] == 2);
+
+    df.check_host("www.jest.com", &flow);
+    CHECK(pc[2] == 2);
+    CHECK(pc[3] == 2);
+
+    CHECK(s_alerts == 2);
+    CHECK(pc[0] == 4);
+    CHECK(pc[1] == 2);
+}
+
+// a host with the length and hash of the cached one but other bytes
+// is looked up
+TEST(domain_filter_flow, hash_collision)
+{
+    Flow flow;
+    PegCount* pc = df.mod->get_counts();
+
+    df.check_host("www.test.com", &flow);
+    CHECK(s_alerts == 1);
+
+    DomainFlowData* fd = (DomainFlowData*)flow.get_flow_data(DomainFlowData::data_id);
+    fd->hash = DomainTable::hash("www.jest.com", 12);
+
+    df.check_host("www.jest.com", &flow);
+    CHECK(pc[2] == 0);
+    CHECK(pc[3] == 2);
+    CHECK(s_alerts == 1);
+}
+
+//--------------------------------------------------------------------------
+
+TEST_GROUP(domain_filter_feed)
+{
+    void teardown() override
+    { df_tterm(); }
+
+    // the slots of the thread's cache holding generation g
+    unsigned cached(uint64_t g)
     {
-        CHECK(snort_plugins[0] != nullptr);
-        CHECK(snort_plugins[0]->type == PT_INSPECTOR);
-        api = (InspectApi*)snort_plugins[0];
+        unsigned n = 0;
 
-        mod = api->base.mod_ctor();
-        CHECK(mod != nullptr);
+        for ( const auto& c : *s_caches )
+            n += c.gen == g;
 
-        Value val("zombie.com\ntest.com apocalypse.com ");
-        mod->set("hosts", val, nullptr);
-        mod->end(nullptr, 0, nullptr);
+        return n;
+    }
+};
 
-        ins = api->ctor(mod);
-        CHECK(ins != nullptr);
+// feeds used by the same thread keep their own cached table
+TEST(domain_filter_feed, slots)
+{
+    DomainTable* ta = new DomainTable;
+    DomainTable* tb = new DomainTable;
+    uint64_t ga, gb, g;
+
+    DomainFeed* a = new DomainFeed(ta);
+    DomainFeed* b = new DomainFeed(tb);
+
+    CHECK(a->get(ga) == ta);
+    CHECK(b->get(gb) == tb);
+    CHECK(ga != gb);
+
+    // both stay cached
+    CHECK(cached(ga) == 1);
+    CHECK(cached(gb) == 1);
+
+    CHECK(a->get(g) == ta and g == ga);
+    CHECK(b->get(g) == tb and g == gb);
+
+    // a new feed reuses the slot of a deleted one
+    delete b;
+    DomainTable* tc = new DomainTable;
+    DomainFeed* c = new DomainFeed(tc);
+
+    size_t slots = s_caches->size();
+    CHECK(c->get(g) == tc and g != gb);
+    CHECK(s_caches->size() == slots);
+    CHECK(cached(gb) == 0);
+    CHECK(cached(ga) == 1);
+    CHECK(a->get(g) == ta and g == ga);
+
+    delete a;
+    delete c;
+}
 
-        CHECK(s_handler != nullptr);
+//--------------------------------------------------------------------------
 
-        mod->get_counts()[0] = 0;
-        mod->get_counts()[1] = 0;
+TEST_GROUP(domain_filter_refresh)
+{
+    DomainFilterFixture df;
+    std::string file;
+
+    void setup() override
+    {
+        file = "domain_filter_test.txt";
+        write("zombie.com\n");
+
+        // the watcher won't wake during the test; refresh() is called here
+        df.start(nullptr, { { "file", file.c_str() }, { "refresh", "3600" } });
     }
 
     void teardown() override
     {
-        api->dtor(ins);
-        api->base.mod_dtor(mod);
-        delete s_handler;
-        s_handler = nullptr;
-        s_alerts = 0;
+        df.stop();
+        remove(file.c_str());
+    }
+
+    void write(const char* hosts)
+    {
+        FILE* fh = fopen(file.c_str(), "w");
+        CHECK(fh != nullptr);
+        fputs(hosts, fh);
+        fclose(fh);
     }
 };
 
-TEST(domain_filter_events, no_host)
+TEST(domain_filter_refresh, changed_file)
 {
-    HttpEvent he(nullptr);
-    s_host = nullptr;
-    s_handler->handle(he, nullptr);
-    CHECK(s_alerts == 0);
-    CHECK(mod->get_counts()[0] == 0);
-    CHECK(mod->get_counts()[1] == 0);
+    df.check_host("zombie.com");
+    df.check_host("www.apocalypse.com");
+    CHECK(s_alerts == 1);
+
+    write("zombie.org\n.apocalypse.com\n");
+    ((DomainFilter*)df.ins)->refresh();
+
+    df.check_host("zombie.com");
+    CHECK(s_alerts == 1);
+
+    df.check_host("www.apocalypse.com");
+    df.check_host("zombie.org");
+    CHECK(s_alerts == 3);
 }
 
-TEST(domain_filter_events, no_alert)
+TEST(domain_filter_refresh, missing_file)
 {
-    HttpEvent he(nullptr);
-    s_host = "jest.com";
-    s_handler->handle(he, nullptr);
-    s_host = "xtest.com";
-    s_handler->handle(he, nullptr);
-    s_host = "test.co";
-    s_handler->handle(he, nullptr);
-    CHECK(s_alerts == 0);
-    CHECK(mod->get_counts()[0] == 3);
-    CHECK(mod->get_counts()[1] == 0);
+    remove(file.c_str());
+    ((DomainFilter*)df.ins)->refresh();
+
+    // the current hosts are kept
+    df.check_host("zombie.com");
+    CHECK(s_alerts == 1);
 }
 
-TEST(domain_filter_events, one_alert)
+//--------------------------------------------------------------------------
+
+TEST_GROUP(domain_filter_image)
 {
-    HttpEvent he(nullptr);
-    s_host = "test.com";
-    s_handler->handle(he, nullptr);
-    CHECK(s_alerts == 1);
-    CHECK(mod->get_counts()[0] == 1);
-    CHECK(mod->get_counts()[1] == 1);
+    DomainFilterFixture df;
+    std::string file;
+    std::string image;
+
+    void setup() override
+    {
+        file = "domain_filter_test.txt";
+        image = "domain_filter_test.img";
+
+        FILE* fh = fopen(file.c_str(), "w");
+        CHECK(fh != nullptr);
+        fputs("zombie.com\n.test.com\n*.apocalypse.com\n", fh);
+        fclose(fh);
+    }
+
+    void teardown() override
+    {
+        remove(file.c_str());
+        remove(image.c_str());
+    }
+
+    void check_alerts()
+    {
+        df.start(nullptr, { { "file", file.c_str() }, { "image", image.c_str() } });
+
+        df.check_host("zombie.com");
+        df.check_host("www.test.com");
+        df.check_host("apocalypse.com");
+        CHECK(s_alerts == 2);
+
+        df.stop();
+    }
+};
+
+TEST(domain_filter_image, build_and_map)
+{
+    // the 1st pass builds the image and the 2nd maps it
+    check_alerts();
+
+    FILE* fh = fopen(image.c_str(), "r");
+    CHECK(fh != nullptr);
+    fclose(fh);
+
+    check_alerts();
 }
 
-TEST(domain_filter_events, mixed_case_alert)
+//--------------------------------------------------------------------------
+
+TEST_GROUP(domain_filter_file)
+{
+    DomainFilterFixture df;
+    std::string file;
+
+    void setup() override
+    { file = "domain_filter_test.txt"; }
+
+    void teardown() override
+    {
+        df.stop();
+        remove(file.c_str());
+    }
+};
+
+TEST(domain_filter_file, skip_invalid)
 {
-    HttpEvent he(nullptr);
-    s_host = "TEST.com";
-    s_handler->handle(he, nullptr);
+    FILE* fh = fopen(file.c_str(), "w");
+    CHECK(fh != nullptr);
+    fputs("zombie.com\nbad..com\n.test.com\n*\nwww.*.com\n", fh);
+    fclose(fh);
+
+    df.start(nullptr, { { "file", file.c_str() } });
+
+    df.check_host("zombie.com");
+    df.check_host("www.test.com");
+    df.check_host("bad..com");
+    CHECK(s_alerts == 2);
+    CHECK(df.mod->get_counts()[0] == 3);
+    CHECK(df.mod->get_counts()[1] == 2);
+}
+
+//--------------------------------------------------------------------------
+
+TEST_GROUP(domain_filter_sources)
+{
+    DomainFilterFixture df;
+
+    void setup() override
+    {
+        df.start(".test.com", { { "sources", "http ssl" } });
+        CHECK(s_ssl_handler != nullptr);
+    }
+
+    void teardown() override
+    { df.stop(); }
+};
+
+TEST(domain_filter_sources, server_name)
+{
+    SslClientHelloEvent hit("www.test.com", nullptr);
+    s_ssl_handler->handle(hit, nullptr);
+
+    SslClientHelloEvent miss("www.jest.com", nullptr);
+    s_ssl_handler->handle(miss, nullptr);
+
     CHECK(s_alerts == 1);
-    CHECK(mod->get_counts()[0] == 1);
-    CHECK(mod->get_counts()[1] == 1);
+    CHECK(df.mod->get_counts()[0] == 2);
+    CHECK(df.mod->get_counts()[1] == 1);
+}
+
+//--------------------------------------------------------------------------
+
+TEST_GROUP(domain_filter_prefilter)
+{
+    DomainFilterFixture df;
+
+    void setup() override
+    { df.start("zombie.com .test.com", { { "prefilter", "true" } }); }
+
+    void teardown() override
+    { df.stop(); }
+};
+
+// the prefilter of this table is fixed so the hosts it rules out are too
+TEST(domain_filter_prefilter, rejects)
+{
+    const char* listed[] = { "zombie.com", "test.com", "www.test.com", "a.b.TEST.com." };
+    const char* unlisted[] =
+    {
+        "apocalypse.com", "example.org", "jest.com", "www.zombie.net",
+        "zombie.org", "mail.example.net", "cdn.jest.io", "test.co"
+    };
+    PegCount* pc = df.mod->get_counts();
+
+    for ( auto host : listed )
+        df.check_host(host);
+
+    CHECK(s_alerts == 4);
+    CHECK(pc[1] == 4);
+    CHECK(pc[4] == 0);
+
+    for ( auto host : unlisted )
+        df.check_host(host);
+
+    CHECK(s_alerts == 4);
+    CHECK(pc[4] == 8);
+
+    // zombie.com gets through the prefilter as the parent of this one
+    df.check_host("www.zombie.com");
+    CHECK(s_alerts == 4);
+    CHECK(pc[4] == 8);
+
+    CHECK(pc[0] == 13);
+    CHECK(pc[1] == 4);
 }
 
 //--------------------------------------------------------------------------
@@ -311,4 +803,3 @@ int main(int argc, char** argv)
 {
     return CommandLineTestRunner::RunAllTests(argc, argv);
 }
-
@@ -0,0 +1,714 @@
+//--------------------------------------------------------------------------
+// Copyright (C) 2025-2025 Cisco and/or its affiliates. All rights reserved.
+//
+// This program is free software; you can redistribute it and/or modify it
+// under the terms of the GNU General Public License Version 2 as published
+// by the Free Software Foundation.  You may not use, modify or distribute
+// this program under any other version of the GNU General Public License.
+//
+// This program is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along
+// with this program; if not, write to the Free Software Foundation, Inc.,
+// 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+//--------------------------------------------------------------------------
+
+// domain_table.cc - the hosts filtered by domain_filter
+
+#include "domain_table.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+// longest name allowed in DNS
+#define DT_MAX_DOMAIN 253
+
+// at most half full
+#define DT_MIN_SLOTS 16
+
+static inline uint8_t fold(uint8_t c)
+{ return (c >= 'A' and c <= 'Z') ? c + ('a' - 'A') : c; }
+
+// fnv-1a over the bytes from the right so the hash of each parent domain
+// is an intermediate value of the hash of the host
+static inline uint64_t hash_byte(uint64_t h, uint8_t c)
+{ return (h ^ fold(c)) * 0x100000001b3ull; }
+
+static const uint64_t s_hash_basis = 0xcbf29ce484222325ull;
+
+static uint64_t hash_domain(const char* s, unsigned len)
+{
+    uint64_t h = s_hash_basis;
+
+    while ( len )
+        h = hash_byte(h, s[--len]);
+
+    return h;
+}
+
+static inline uint32_t hash_tag(uint64_t h)
+{ return (uint32_t)(h >> 32); }
+
+static uint64_t hash_bytes(uint64_t h, const void* p, size_t n)
+{
+    const uint8_t* b = (const uint8_t*)p;
+
+    while ( n-- )
+        h = (h ^ *b++) * 0x100000001b3ull;
+
+    return h;
+}
+
+bool DomainTable::parse(const std::string& s, std::string& domain, uint8_t& flags, bool suffix)
+{
+    size_t start = 0;
+
+    if ( s.compare(0, 2, "*.") == 0 )
+    {
+        flags = SUBDOMAINS;
+        start = 2;
+    }
+    else if ( s.compare(0, 1, ".") == 0 )
+    {
+        flags = SELF | SUBDOMAINS;
+        start = 1;
+    }
+    else
+        flags = suffix ? (SELF | SUBDOMAINS) : SELF;
+
+    size_t end = s.size();
+
+    if ( end > start and s[end - 1] == '.' )
+        end--;
+
+    if ( end <= start or end - start > DT_MAX_DOMAIN )
+        return false;
+
+    domain.assign(s, start, end - start);
+    transform(domain.begin(), domain.end(), domain.begin(), ::tolower);
+
+    // labels must be non-empty and wildcards are only allowed up front
+    if ( domain.front() == '.' or domain.back() == '.' or
+        domain.find("..") != std::string::npos or domain.find('*') != std::string::npos )
+        return false;
+
+    return true;
+}
+
+bool DomainTable::valid(const std::string& s)
+{
+    std::string domain;
+    uint8_t flags;
+
+    return parse(s, domain, flags, false);
+}
+
+const DomainTable::Slot* DomainTable::find(const char* s, unsigned len, uint64_t hash) const
+{
+    if ( slots.empty() or len > DT_MAX_DOMAIN )
+        return nullptr;
+
+    size_t mask = slots.size() - 1;
+    size_t i = hash & mask;
+    uint32_t tag = hash_tag(hash);
+
+    while ( slots[i].len )
+    {
+        const Slot& e = slots[i];
+
+        if ( e.tag == tag and e.len == len )
+        {
+            const char* d = pool.data() + e.off;
+            unsigned k = 0;
+
+            while ( k < len and fold(s[k]) == (uint8_t)d[k] )
+                k++;
+
+            if ( k == len )
+                return &e;
+        }
+        i = (i + 1) & mask;
+    }
+    return nullptr;
+}
+
+void DomainTable::grow()
+{
+    std::vector<Slot> old(slots.empty() ? DT_MIN_SLOTS : slots.size() * 2, Slot());
+    old.swap(slots);
+
+    size_t mask = slots.size() - 1;
+
+    for ( const auto& e : old )
+    {
+        if ( !e.len )
+            continue;
+
+        size_t i = hash_domain(pool.data() + e.off, e.len) & mask;
+
+        while ( slots[i].len )
+            i = (i + 1) & mask;
+
+        slots[i] = e;
+    }
+}
+
+bool DomainTable::add(const std::string& s)
+{
+    std::string domain;
+    uint8_t flags;
+
+    if ( !parse(s, domain, flags, suffix) )
+        return false;
+
+    uint64_t hash = hash_domain(domain.data(), domain.size());
+    Slot* e = const_cast<Slot*>(find(domain.data(), domain.size(), hash));
+
+    if ( e )
+    {
+        e->flags |= flags;
+        return true;
+    }
+
+    if ( 2 * (count + 1) > slots.size() )
+        grow();
+
+    size_t mask = slots.size() - 1;
+    size_t i = hash & mask;
+
+    while ( slots[i].len )
+        i = (i + 1) & mask;
+
+    slots[i].tag = hash_tag(hash);
+    slots[i].off = pool.size();
+    slots[i].len = domain.size();
+    slots[i].flags = flags;
+
+    pool += domain;
+    count++;
+
+    if ( blocks )
+        prefilter_add(hash);
+
+    return true;
+}
+
+uint8_t DomainTable::lookup(const char* s, unsigned len, uint64_t hash) const
+{
+    const Slot* e = find(s, len, hash);
+    uint8_t flags = e ? e->flags : 0;
+
+    if ( image )
+        flags |= image_find(s, len, hash);
+
+    return flags;
+}
+
+bool DomainTable::match(const char* host, unsigned len, bool* rejected) const
+{
+    if ( rejected )
+        *rejected = false;
+
+    if ( len and host[len - 1] == '.' )
+        len--;
+
+    if ( !len or empty() )
+        return false;
+
+    // each parent domain is probed when its leading dot is reached
+    uint64_t h = s_hash_basis;
+    unsigned i = len;
+    unsigned probes = 0;
+
+    while ( i-- )
+    {
+        if ( host[i] == '.' and (!blocks or prefilter_maybe(h)) )
+        {
+            probes++;
+
+            if ( lookup(host + i + 1, len - i - 1, h) & SUBDOMAINS )
+                return true;
+        }
+        h = hash_byte(h, host[i]);
+    }
+
+    if ( !blocks or prefilter_maybe(h) )
+        return lookup(host, len, h) & SELF;
+
+    if ( rejected and !probes )
+        *rejected = true;
+
+    return false;
+}
+
+uint64_t DomainTable::hash(const char* host, unsigned len)
+{
+    if ( len and host[len - 1] == '.' )
+        len--;
+
+    return hash_domain(host, len);
+}
+
+void DomainTable::get_entries(std::vector<std::string>& v) const
+{
+    v.clear();
+    v.reserve(count);
+
+    for ( const auto& e : slots )
+    {
+        if ( !e.len )
+            continue;
+
+        std::string d(pool, e.off, e.len);
+
+        switch ( e.flags )
+        {
+        case SELF:
+            v.emplace_back(d);
+            break;
+        case SUBDOMAINS:
+            v.emplace_back("*." + d);
+            break;
+        default:
+            v.emplace_back("." + d);
+            break;
+        }
+    }
+
+    std::sort(v.begin(), v.end());
+}
+
+//--------------------------------------------------------------------------
+// compiled images
+//
+// An image has a header, the displacement of each bucket, the entries
+// and the domains.  A domain hashes to a bucket and the bucket's
+// displacement gives the domain's entry, different for each domain in
+// the list (hash and displace).  Domains not in the list still land on
+// some entry so the fingerprint, the low bits of the hash, rejects nearly
+// all of those before the domain is compared.
+//--------------------------------------------------------------------------
+
+#define DT_IMAGE_MAGIC   "DOMAINIM"
+#define DT_IMAGE_VERSION 1
+
+// domains per bucket on average
+#define DT_BUCKET_SIZE 4
+
+struct DomainImage
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t header_size;   // catches layout changes
+
+    uint64_t stamp;         // of the source list
+    uint64_t size;          // of the whole image
+
+    uint32_t count;         // entries
+    uint32_t buckets;
+
+    uint64_t disp_off;      // uint32_t[buckets]
+    uint64_t entry_off;     // DomainImageEntry[count]
+    uint64_t pool_off;      // char[pool_size]
+    uint64_t pool_size;
+};
+
+struct DomainImageEntry
+{
+    uint32_t fp;            // low bits of the hash
+    uint32_t off;           // of the domain in the pool
+    uint8_t len;
+    uint8_t flags;
+    uint16_t unused;
+};
+
+static inline uint64_t mix(uint64_t h)
+{
+    h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ull;
+    h = (h ^ (h >> 27)) * 0x94d049bb133111ebull;
+    return h ^ (h >> 31);
+}
+
+static inline uint32_t image_bucket(uint64_t h, uint32_t buckets)
+{ return ((h >> 32) * buckets) >> 32; }
+
+static inline uint32_t image_entry(uint64_t h, uint32_t disp, uint32_t count)
+{ return ((mix(h + disp * 0x9e3779b97f4a7c15ull) >> 32) * count) >> 32; }
+
+static inline bool image_fits(const DomainImage* img, uint64_t off, uint64_t len)
+{ return off <= img->size and len <= img->size - off; }
+
+DomainTable::~DomainTable()
+{ unload(); }
+
+void DomainTable::unload()
+{
+    if ( image )
+        munmap((void*)image, image->size);
+
+    image = nullptr;
+    image_file.clear();
+}
+
+size_t DomainTable::image_size() const
+{ return image ? image->count : 0; }
+
+uint8_t DomainTable::image_find(const char* s, unsigned len, uint64_t hash) const
+{
+    if ( !image->count )
+        return 0;
+
+    const uint8_t* base = (const uint8_t*)image;
+    const uint32_t* disp = (const uint32_t*)(base + image->disp_off);
+    const DomainImageEntry* ent = (const DomainImageEntry*)(base + image->entry_off);
+
+    uint32_t d = disp[image_bucket(hash, image->buckets)];
+    const DomainImageEntry& e = ent[image_entry(hash, d, image->count)];
+
+    if ( e.fp != (uint32_t)hash or e.len != len )
+        return 0;
+
+    const char* p = (const char*)base + image->pool_off + e.off;
+
+    for ( unsigned k = 0; k < len; k++ )
+    {
+        if ( fold(s[k]) != (uint8_t)p[k] )
+            return 0;
+    }
+    return e.flags;
+}
+
+bool DomainTable::get_stamp(const char* file, uint64_t& stamp) const
+{
+    struct stat st;
+
+    if ( stat(file, &st) )
+        return false;
+
+#ifdef __APPLE__
+    const struct timespec& mtime = st.st_mtimespec;
+#else
+    const struct timespec& mtime = st.st_mtim;
+#endif
+
+    uint64_t v[] =
+    {
+        DT_IMAGE_VERSION, suffix, (uint64_t)st.st_dev, (uint64_t)st.st_ino,
+        (uint64_t)st.st_size, (uint64_t)mtime.tv_sec, (uint64_t)mtime.tv_nsec
+    };
+    stamp = hash_bytes(s_hash_basis, v, sizeof(v));
+
+    // 0 means any
+    if ( !stamp )
+        stamp = 1;
+
+    return true;
+}
+
+bool DomainTable::save(const char* path, uint64_t stamp) const
+{
+    std::vector<const Slot*> src;
+    std::vector<uint64_t> keys;
+
+    src.reserve(count);
+    keys.reserve(count);
+
+    for ( const auto& e : slots )
+    {
+        if ( !e.len )
+            continue;
+
+        src.push_back(&e);
+        keys.push_back(hash_domain(pool.data() + e.off, e.len));
+    }
+
+    uint32_t n = keys.size();
+    uint32_t buckets = n / DT_BUCKET_SIZE + 1;
+
+    // keys by bucket
+    std::vector<uint32_t> start(buckets + 1, 0);
+    std::vector<uint32_t> order(n);
+
+    for ( uint32_t k = 0; k < n; k++ )
+        start[image_bucket(keys[k], buckets) + 1]++;
+
+    for ( uint32_t b = 0; b < buckets; b++ )
+        start[b + 1] += start[b];
+
+    std::vector<uint32_t> next(start.begin(), start.end() - 1);
+
+    for ( uint32_t k = 0; k < n; k++ )
+        order[next[image_bucket(keys[k], buckets)]++] = k;
+
+    // place the biggest buckets first while most entries are free
+    std::vector<uint32_t> by_size(buckets);
+
+    for ( uint32_t b = 0; b < buckets; b++ )
+        by_size[b] = b;
+
+    std::stable_sort(by_size.begin(), by_size.end(), [&start](uint32_t a, uint32_t b)
+        { return start[a + 1] - start[a] > start[b + 1] - start[b]; });
+
+    std::vector<uint32_t> disp(buckets, 0);
+    std::vector<uint32_t> slot_of(n);
+    std::vector<bool> used(n, false);
+    std::vector<uint32_t> pos;
+
+    for ( uint32_t b : by_size )
+    {
+        uint32_t first = start[b], last = start[b + 1];
+
+        if ( first == last )
+            break;
+
+        for ( uint32_t d = 0; ; d++ )
+        {
+            // domains with the same hash can't be told apart
+            if ( d == UINT32_MAX )
+                return false;
+
+            pos.clear();
+
+            for ( uint32_t i = first; i < last; i++ )
+            {
+                uint32_t p = image_entry(keys[order[i]], d, n);
+
+                if ( used[p] or std::find(pos.begin(), pos.end(), p) != pos.end() )
+                    break;
+
+                pos.push_back(p);
+            }
+
+            if ( pos.size() < last - first )
+                continue;
+
+            for ( uint32_t i = first; i < last; i++ )
+            {
+                used[pos[i - first]] = true;
+                slot_of[order[i]] = pos[i - first];
+            }
+            disp[b] = d;
+            break;
+        }
+    }
+
+    DomainImage img;
+    memset(&img, 0, sizeof(img));
+
+    memcpy(img.magic, DT_IMAGE_MAGIC, sizeof(img.magic));
+    img.version = DT_IMAGE_VERSION;
+    img.header_size = sizeof(img);
+    img.stamp = stamp;
+    img.count = n;
+    img.buckets = buckets;
+
+    img.disp_off = sizeof(img);
+    img.entry_off = img.disp_off + (uint64_t)buckets * sizeof(uint32_t);
+    img.pool_off = img.entry_off + (uint64_t)n * sizeof(DomainImageEntry);
+    img.pool_size = pool.size();
+    img.size = img.pool_off + img.pool_size;
+
+    std::vector<uint8_t> buf(img.size, 0);
+    uint8_t* base = buf.data();
+
+    memcpy(base, &img, sizeof(img));
+    memcpy(base + img.disp_off, disp.data(), buckets * sizeof(uint32_t));
+
+    DomainImageEntry* ent = (DomainImageEntry*)(base + img.entry_off);
+    char* ipool = (char*)base + img.pool_off;
+    uint32_t off = 0;
+
+    for ( uint32_t k = 0; k < n; k++ )
+    {
+        DomainImageEntry& e = ent[slot_of[k]];
+        const Slot* sp = src[k];
+
+        e.fp = (uint32_t)keys[k];
+        e.off = off;
+        e.len = sp->len;
+        e.flags = sp->flags;
+
+        memcpy(ipool + off, pool.data() + sp->off, sp->len);
+        off += sp->len;
+    }
+
+    // written under a unique temporary name and renamed so a partial
+    // image is never mapped and concurrent writers can't collide
+    std::string tmp = std::string(path) + ".XXXXXX";
+    int fd = mkstemp(&tmp[0]);
+
+    if ( fd < 0 )
+        return false;
+
+    // mkstemp makes the file private but images are mapped by other runs
+    FILE* fh = fchmod(fd, 0644) ? nullptr : fdopen(fd, "wb");
+
+    if ( !fh )
+    {
+        close(fd);
+        unlink(tmp.c_str());
+        return false;
+    }
+
+    bool ok = fwrite(base, 1, img.size, fh) == img.size;
+
+    if ( fclose(fh) )
+        ok = false;
+
+    if ( !ok or rename(tmp.c_str(), path) )
+    {
+        unlink(tmp.c_str());
+        return false;
+    }
+    return true;
+}
+
+bool DomainTable::load(const char* path, uint64_t stamp)
+{
+    int fd = open(path, O_RDONLY);
+
+    if ( fd < 0 )
+        return false;
+
+    struct stat st;
+
+    if ( fstat(fd, &st) or (size_t)st.st_size < sizeof(DomainImage) )
+    {
+        close(fd);
+        return false;
+    }
+
+    size_t size = st.st_size;
+    void* map = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+
+    if ( map == MAP_FAILED )
+        return false;
+
+    // images may be stale or damaged so everything the lookup follows is
+    // checked before use
+    const DomainImage* img = (const DomainImage*)map;
+    const uint8_t* base = (const uint8_t*)map;
+
+    bool ok = !memcmp(img->magic, DT_IMAGE_MAGIC, sizeof(img->magic)) and
+        img->version == DT_IMAGE_VERSION and img->header_size == sizeof(DomainImage) and
+        img->size == size and (!stamp or img->stamp == stamp) and img->buckets and
+        !(img->disp_off % alignof(uint32_t)) and !(img->entry_off % alignof(DomainImageEntry)) and
+        image_fits(img, img->disp_off, (uint64_t)img->buckets * sizeof(uint32_t)) and
+        image_fits(img, img->entry_off, (uint64_t)img->count * sizeof(DomainImageEntry)) and
+        image_fits(img, img->pool_off, img->pool_size);
+
+    if ( ok )
+    {
+        const DomainImageEntry* ent = (const DomainImageEntry*)(base + img->entry_off);
+
+        for ( uint32_t k = 0; ok and k < img->count; k++ )
+        {
+            const DomainImageEntry& e = ent[k];
+
+            ok = e.len and e.len <= DT_MAX_DOMAIN and e.flags and !(e.flags & ~(SELF | SUBDOMAINS)) and
+                e.off <= img->pool_size and e.len <= img->pool_size - e.off;
+        }
+    }
+
+    if ( !ok )
+    {
+        munmap(map, size);
+        return false;
+    }
+
+    unload();
+    image = img;
+    image_file = path;
+
+    if ( blocks )
+        add_prefilter();
+
+    return true;
+}
+
+//--------------------------------------------------------------------------
+// prefilter
+//
+// A split block Bloom filter: each domain sets one bit in each of the 8
+// words of one 32 byte block.  At 16 bits per domain about 1 in 1000
+// unlisted domains gets through.
+//--------------------------------------------------------------------------
+
+#define DT_BLOOM_WORDS 8
+#define DT_BLOOM_BITS_PER_DOMAIN 16
+
+static const uint32_t s_bloom_salt[DT_BLOOM_WORDS] =
+{
+    0x47b6137bU, 0x44974d91U, 0x8824ad5bU, 0xa2b7289dU,
+    0x705495c7U, 0x2df1424bU, 0x9efc4947U, 0x5c6bfb31U
+};
+
+static inline uint32_t bloom_block(uint64_t h, uint32_t nblocks)
+{ return ((h >> 32) * nblocks) >> 32; }
+
+static inline uint32_t bloom_bit(uint64_t h, unsigned word)
+{ return 1U << (((uint32_t)h * s_bloom_salt[word]) >> 27); }
+
+void DomainTable::prefilter_add(uint64_t hash)
+{
+    uint64_t h = mix(hash);
+    uint32_t* b = blocks + bloom_block(h, nblocks) * DT_BLOOM_WORDS;
+
+    for ( unsigned w = 0; w < DT_BLOOM_WORDS; w++ )
+        b[w] |= bloom_bit(h, w);
+}
+
+bool DomainTable::prefilter_maybe(uint64_t hash) const
+{
+    uint64_t h = mix(hash);
+    const uint32_t* b = blocks + bloom_block(h, nblocks) * DT_BLOOM_WORDS;
+
+    for ( unsigned w = 0; w < DT_BLOOM_WORDS; w++ )
+    {
+        if ( !(b[w] & bloom_bit(h, w)) )
+            return false;
+    }
+    return true;
+}
+
+void DomainTable::add_prefilter()
+{
+    const unsigned block_bits = DT_BLOOM_WORDS * 32;
+    uint64_t n = size() ? size() : 1;
+
+    nblocks = (n * DT_BLOOM_BITS_PER_DOMAIN + block_bits - 1) / block_bits;
+
+    // align blocks to their size so each is in one cache line
+    bloom.assign((size_t)nblocks * DT_BLOOM_WORDS + DT_BLOOM_WORDS, 0);
+    uintptr_t p = (uintptr_t)bloom.data();
+    size_t skip = ((DT_BLOOM_WORDS * 4 - p % (DT_BLOOM_WORDS * 4)) % (DT_BLOOM_WORDS * 4)) / 4;
+    blocks = bloom.data() + skip;
+
+    for ( const auto& e : slots )
+    {
+        if ( e.len )
+            prefilter_add(hash_domain(pool.data() + e.off, e.len));
+    }
+
+    if ( !image )
+        return;
+
+    const uint8_t* base = (const uint8_t*)image;
+    const DomainImageEntry* ent = (const DomainImageEntry*)(base + image->entry_off);
+    const char* ipool = (const char*)base + image->pool_off;
+
+    for ( uint32_t k = 0; k < image->count; k++ )
+        prefilter_add(hash_domain(ipool + ent[k].off, ent[k].len));
+}
+
@@ -0,0 +1,160 @@
+//--------------------------------------------------------------------------
+// Copyright (C) 2025-2025 Cisco and/or its affiliates. All rights reserved.
+//
+// This program is free software; you can redistribute it and/or modify it
+// under the terms of the GNU General Public License Version 2 as published
+// by the Free Software Foundation.  You may not use, modify or distribute
+// this program under any other version of the GNU General Public License.
+//
+// This program is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along
+// with this program; if not, write to the Free Software Foundation, Inc.,
+// 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+//--------------------------------------------------------------------------
+
+// domain_table.h - the hosts filtered by domain_filter
+//
+// Entries are domains with an optional prefix:
+//
+//     example.com     matches example.com only, or its subdomains too
+//                     when the table is built with suffix set
+//     .example.com    matches example.com and its subdomains
+//     *.example.com   matches the subdomains of example.com only
+//
+// Each entry is stored once, keyed by the domain, with flags saying
+// whether the domain itself and/or its subdomains match.  A lookup checks
+// the whole host and then each parent domain, so it takes one probe per
+// label.
+//
+// Domains are lowercased into a string pool and indexed by a flat open
+// addressing table.  Hosts are hashed from the right with case folded so
+// the hash of each parent domain falls out of a single pass over the host
+// and lookups do not allocate or copy.
+//
+// Large lists may instead be saved as a compiled image and mapped read
+// only, see save() and load().  The image is indexed by a minimal perfect
+// hash with a fingerprint per entry, so it takes about 13 bytes per domain
+// plus the domain itself, and mapping it is much faster than reading the
+// list.  Entries added to a table with an image are kept in the flat
+// table and both are checked.
+//
+// Most hosts are not listed, so large tables may also have a prefilter, a
+// blocked Bloom filter over all entries.  Each domain checked costs one
+// 32 byte block and nearly all unlisted domains end there, without
+// probing the table or image.
+
+#ifndef DOMAIN_TABLE_H
+#define DOMAIN_TABLE_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+struct DomainImage;
+
+class DomainTable
+{
+public:
+    DomainTable(bool suffix = false) : suffix(suffix) { }
+    ~DomainTable();
+
+    DomainTable(const DomainTable&) = delete;
+    DomainTable& operator=(const DomainTable&) = delete;
+
+    // false if the entry is not a domain
+    static bool valid(const std::string&);
+
+    // false if the entry is not a domain
+    bool add(const std::string&);
+
+    // case is ignored; a trailing dot is allowed.  rejected is set if the
+    // prefilter ruled out the host without probing the table.
+    bool match(const char* host, unsigned len, bool* rejected = nullptr) const;
+
+    // identifies a host for caching its verdict, same case rules as match
+    static uint64_t hash(const char* host, unsigned len);
+
+    bool empty() const
+    { return !size(); }
+
+    size_t size() const
+    { return count + image_size(); }
+
+    // entries in the image
+    size_t image_size() const;
+
+    const std::string& get_image() const
+    { return image_file; }
+
+    bool get_suffix() const
+    { return suffix; }
+
+    // in entry syntax, sorted; not including the image
+    void get_entries(std::vector<std::string>&) const;
+
+    // identifies the state of a list file and how it is parsed;
+    // false if the file can't be read
+    bool get_stamp(const char* file, uint64_t& stamp) const;
+
+    // write the entries, not including any image, as an image stamped
+    // with the stamp of their source list
+    bool save(const char* path, uint64_t stamp) const;
+
+    // map an image if it is intact and has the given stamp, any stamp
+    // if 0
+    bool load(const char* path, uint64_t stamp);
+
+    // build a prefilter sized for the current entries, including the
+    // image; later entries are added to it
+    void add_prefilter();
+
+    bool has_prefilter() const
+    { return blocks != nullptr; }
+
+private:
+    enum : uint8_t
+    {
+        SELF = 0x01,        // the domain itself matches
+        SUBDOMAINS = 0x02,  // domains under it match
+    };
+
+    struct Slot
+    {
+        uint32_t tag;       // high bits of the hash
+        uint32_t off;       // of the domain in pool
+        uint8_t len;        // 0 if empty
+        uint8_t flags;
+    };
+
+    static bool parse(const std::string&, std::string& domain, uint8_t& flags, bool suffix);
+
+    const Slot* find(const char* s, unsigned len, uint64_t hash) const;
+    void grow();
+
+    uint8_t lookup(const char* s, unsigned len, uint64_t hash) const;
+    uint8_t image_find(const char* s, unsigned len, uint64_t hash) const;
+    void unload();
+
+    void prefilter_add(uint64_t hash);
+    bool prefilter_maybe(uint64_t hash) const;
+
+private:
+    std::vector<Slot> slots;    // size is a power of 2
+    std::string pool;           // lowercase domains
+    size_t count = 0;
+    bool suffix;
+
+    const DomainImage* image = nullptr;
+    std::string image_file;
+
+    std::vector<uint32_t> bloom;    // blocks and room to align them
+    uint32_t* blocks = nullptr;     // 8 words each
+    uint32_t nblocks = 0;
+};
+
+#endif
+
@@ -0,0 +1,462 @@
+//--------------------------------------------------------------------------
+// Copyright (C) 2025-2025 Cisco and/or its affiliates. All rights reserved.
+//
+// This program is free software; you can redistribute it and/or modify it
+// under the terms of the GNU General Public License Version 2 as published
+// by the Free Software Foundation.  You may not use, modify or distribute
+// this program under any other version of the GNU General Public License.
+//
+// This program is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along
+// with this program; if not, write to the Free Software Foundation, Inc.,
+// 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+//--------------------------------------------------------------------------
+
+// ktrie_bench.cc - standalone throughput benchmark for the lowmem trie
+//
+// Pattern sets are read from files (one per line, \xHH escapes allowed)
+// or generated from a count and length range.  Each set is compiled and
+// then searched over the corpus files or a generated corpus with the
+// automatic search path and with the BC and NoBC paths forced.  One line
+// is printed per case so runs can be diffed.  With no sets given a fixed
+// suite covering long, short, and mixed length patterns is run.
+
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "sfksearch.h"
+
+using namespace std;
+
+typedef chrono::steady_clock Clock;
+
+struct PatternSet
+{
+    string name;
+    vector<string> pats;
+};
+
+struct Corpus
+{
+    string name;
+    string data;
+};
+
+static unsigned alphabet = 256;
+static bool nocase = false;
+static unsigned reps = 5;
+static unsigned updates = 0;
+static KTRIE_CONFIG config = { 1, nullptr, 0, 0, false, false, false };
+static mt19937 rng;
+
+//-------------------------------------------------------------------------
+// stub agent - there are no rules so only the match count is kept
+//-------------------------------------------------------------------------
+
+static int bench_build_tree(snort::SnortConfig*, void*, void**)
+{ return 0; }
+
+static int bench_negate_list(void*, void**)
+{ return 0; }
+
+static void bench_user_free(void*) { }
+static void bench_tree_free(void**) { }
+static void bench_list_free(void**) { }
+
+static MpseAgent bench_agent =
+{
+    bench_build_tree,
+    bench_negate_list,
+    bench_user_free,
+    bench_tree_free,
+    bench_list_free
+};
+
+static int bench_match(void*, void*, int, void* context, void*)
+{
+    (*(uint64_t*)context)++;
+    return 0;
+}
+
+//-------------------------------------------------------------------------
+// inputs
+//-------------------------------------------------------------------------
+
+static uint8_t random_byte()
+{
+    return (uint8_t)(rng() % alphabet);
+}
+
+static bool unescape(const string& in, string& out)
+{
+    out.clear();
+
+    for ( size_t i = 0; i < in.size(); i++ )
+    {
+        if ( in[i] == '\\' and i + 3 < in.size() and in[i+1] == 'x' )
+        {
+            char hex[3] = { in[i+2], in[i+3], 0 };
+            char* end;
+            long c = strtol(hex, &end, 16);
+
+            if ( *end )
+                return false;
+
+            out += (char)c;
+            i += 3;
+        }
+        else
+            out += in[i];
+    }
+    return true;
+}
+
+static bool load_patterns(const char* file, PatternSet& ps)
+{
+    ifstream in(file);
+
+    if ( !in )
+    {
+        fprintf(stderr, "can't open %s\n", file);
+        return false;
+    }
+
+    string line, pat;
+
+    while ( getline(in, line) )
+    {
+        if ( line.empty() )
+            continue;
+
+        if ( !unescape(line, pat) )
+        {
+            fprintf(stderr, "bad escape in %s: %s\n", file, line.c_str());
+            return false;
+        }
+        ps.pats.push_back(pat);
+    }
+
+    ps.name = file;
+    return true;
+}
+
+static bool generate_patterns(const char* spec, PatternSet& ps)
+{
+    unsigned n, lo, hi;
+
+    if ( sscanf(spec, "%u:%u:%u", &n, &lo, &hi) != 3 or !n or !lo or lo > hi )
+    {
+        fprintf(stderr, "bad pattern spec %s, want count:min:max\n", spec);
+        return false;
+    }
+
+    for ( unsigned i = 0; i < n; i++ )
+    {
+        unsigned len = lo + rng() % (hi - lo + 1);
+        string pat;
+
+        for ( unsigned k = 0; k < len; k++ )
+            pat += (char)random_byte();
+
+        ps.pats.push_back(pat);
+    }
+
+    ps.name = string("gen:") + spec;
+    return true;
+}
+
+static bool load_corpus(const char* file, Corpus& c)
+{
+    ifstream in(file, ios::binary);
+
+    if ( !in )
+    {
+        fprintf(stderr, "can't open %s\n", file);
+        return false;
+    }
+
+    c.data.assign(istreambuf_iterator<char>(in), istreambuf_iterator<char>());
+    c.name = file;
+    return true;
+}
+
+// random bytes with about one pattern planted per 4K so there are matches
+static void generate_corpus(size_t size, const PatternSet& ps, Corpus& c)
+{
+    c.data.resize(size);
+
+    for ( auto& b : c.data )
+        b = (char)random_byte();
+
+    for ( size_t i = 0; size and i < size / 4096; i++ )
+    {
+        const string& p = ps.pats[rng() % ps.pats.size()];
+        size_t off = rng() % size;
+
+        if ( off + p.size() <= size )
+            c.data.replace(off, p.size(), p);
+    }
+
+    c.name = "gen:" + to_string(size);
+}
+
+//-------------------------------------------------------------------------
+// cases
+//-------------------------------------------------------------------------
+
+static const char* method_name(const KTRIE_STRUCT* ks)
+{
+    switch ( ks->method )
+    {
+    case KTRIE_METHOD_NOBC: return "nobc";
+    case KTRIE_METHOD_BC:   return "bc";
+    }
+
+    if ( ks->scan )
+        return "auto/scan";
+
+    if ( ks->wmShift )
+        return "auto/wm";
+
+    return ks->bcSize < 3 ? "auto/nobc" : "auto/bc";
+}
+
+static void run_case(const PatternSet& ps, const Corpus& c, int method)
+{
+    KTRIE_STRUCT* ks = KTrieNew(method, &bench_agent, &config);
+
+    for ( unsigned i = 0; i < ps.pats.size(); i++ )
+    {
+        const string& p = ps.pats[i];
+        KTrieAddPattern(ks, (const uint8_t*)p.data(), p.size(), nocase, false, (void*)(uintptr_t)(i + 1));
+    }
+
+    auto start = Clock::now();
+    KTrieCompile(nullptr, ks);
+    double compile_ms = chrono::duration<double, milli>(Clock::now() - start).count();
+
+    KTRIE_WALKSTATS w0;
+    KTrieGetWalkStats(&w0);
+
+    uint64_t matches = 0;
+    start = Clock::now();
+
+    for ( unsigned r = 0; r < reps; r++ )
+        KTrieSearch(ks, (const uint8_t*)c.data.data(), (int)c.data.size(), bench_match, &matches);
+
+    double ns = chrono::duration<double, nano>(Clock::now() - start).count();
+    double bytes = (double)c.data.size() * reps;
+
+    printf("%-20s %-16s %-10s %8zu %10.2f %12zu %6u %8.3f %12.0f %10" PRIu64 "\n",
+        ps.name.c_str(), c.name.c_str(), method_name(ks), ps.pats.size(), compile_ms,
+        ks->memory, ks->fdenses, bytes ? ns / bytes : 0.0, ns ? matches * 1e9 / ns : 0.0, matches / reps);
+
+    if ( config.walk_stats )
+    {
+        KTRIE_WALKSTATS w;
+        KTrieGetWalkStats(&w);
+
+        uint64_t attempts = w.attempts - w0.attempts;
+        uint64_t steps = w.steps - w0.steps;
+        uint64_t shifts = w.shifts - w0.shifts;
+
+        printf("    walks: %.3f attempts/byte %.2f nodes/attempt %.2f probes/node "
+            "%.2f bytes/skip max depth so far %" PRIu64 "\n",
+            bytes ? attempts / bytes : 0.0,
+            attempts ? (double)steps / attempts : 0.0,
+            steps ? (double)(w.probes - w0.probes) / steps : 0.0,
+            shifts ? (double)(w.shift_bytes - w0.shift_bytes) / shifts : 0.0,
+            w.max_depth);
+    }
+
+    KTrieDelete(ks);
+}
+
+// time replacing some patterns of a compiled trie against compiling it
+static void run_update(const PatternSet& ps)
+{
+    KTRIE_CONFIG uconfig = config;
+    uconfig.share = false;
+    uconfig.incremental = true;
+
+    KTRIE_STRUCT* ks = KTrieNew(KTRIE_METHOD_AUTO, &bench_agent, &uconfig);
+
+    for ( unsigned i = 0; i < ps.pats.size(); i++ )
+    {
+        const string& p = ps.pats[i];
+        KTrieAddPattern(ks, (const uint8_t*)p.data(), p.size(), nocase, false, (void*)(uintptr_t)(i + 1));
+    }
+
+    auto start = Clock::now();
+    KTrieCompile(nullptr, ks);
+    double compile_ms = chrono::duration<double, milli>(Clock::now() - start).count();
+
+    unsigned n = updates < ps.pats.size() ? updates : ps.pats.size();
+    vector<unsigned> pick;
+
+    for ( unsigned k = 0; k < n; k++ )
+        pick.push_back(rng() % ps.pats.size());
+
+    sort(pick.begin(), pick.end());
+    pick.erase(unique(pick.begin(), pick.end()), pick.end());
+
+    start = Clock::now();
+
+    for ( auto i : pick )
+    {
+        const string& p = ps.pats[i];
+        KTrieRemovePattern(ks, (const uint8_t*)p.data(), p.size(), nocase, false, (void*)(uintptr_t)(i + 1));
+        KTrieAddPattern(ks, (const uint8_t*)p.data(), p.size(), nocase, false, (void*)(uintptr_t)(i + 1));
+    }
+
+    int rval = KTrieUpdate(nullptr, ks);
+    double update_ms = chrono::duration<double, milli>(Clock::now() - start).count();
+
+    printf("%-20s %-16s %-10s %8zu %10.2f %12zu update of %zu patterns %.2f ms%s\n",
+        ps.name.c_str(), "-", "update", ps.pats.size(), compile_ms, ks->memory,
+        pick.size(), update_ms, rval ? " failed" : "");
+
+    KTrieDelete(ks);
+}
+
+static void usage(const char* prog)
+{
+    fprintf(stderr,
+        "usage: %s [options]\n"
+        "  -p file       patterns, one per line with \\xHH escapes (may repeat)\n"
+        "  -g n:min:max  generate n patterns of min to max bytes (may repeat)\n"
+        "  -c file       corpus (may repeat)\n"
+        "  -s bytes      size of the generated corpus if no -c (16M)\n"
+        "  -a n          alphabet size of generated data (256)\n"
+        "  -i            patterns are case insensitive\n"
+        "  -r n          searches per case (5)\n"
+        "  -d n          trie levels that may get direct child tables (0)\n"
+        "  -m bytes      memory budget per trie for direct child tables (0 = none)\n"
+        "  -w            print trie walk statistics of each case\n"
+        "  -u n          also time replacing n patterns of each set in place\n"
+        "  -x seed       random seed (1)\n", prog);
+}
+
+int main(int argc, char** argv)
+{
+    vector<PatternSet> sets;
+    vector<Corpus> corpora;
+    size_t corpus_size = 16 * 1024 * 1024;
+    unsigned seed = 1;
+    int opt;
+
+    // inputs are loaded after the seed is known
+    vector<pair<int, const char*>> inputs;
+
+    while ( (opt = getopt(argc, argv, "p:g:c:s:a:ir:d:m:wu:x:h")) != -1 )
+    {
+        switch ( opt )
+        {
+        case 'p': case 'g': case 'c':
+            inputs.push_back({ opt, optarg });
+            break;
+        case 's': corpus_size = strtoul(optarg, nullptr, 0); break;
+        case 'a': alphabet = strtoul(optarg, nullptr, 0); break;
+        case 'i': nocase = true; break;
+        case 'r': reps = strtoul(optarg, nullptr, 0); break;
+        case 'd': config.dense_levels = strtoul(optarg, nullptr, 0); break;
+        case 'm': config.memory_budget = strtoull(optarg, nullptr, 0); break;
+        case 'w': config.walk_stats = true; break;
+        case 'u': updates = strtoul(optarg, nullptr, 0); break;
+        case 'x': seed = strtoul(optarg, nullptr, 0); break;
+        default:
+            usage(argv[0]);
+            return opt == 'h' ? 0 : 1;
+        }
+    }
+
+    if ( alphabet < 1 or alphabet > 256 or !reps )
+    {
+        usage(argv[0]);
+        return 1;
+    }
+
+    rng.seed(seed);
+    KTrie_init_xlatcase();
+
+    for ( auto& in : inputs )
+    {
+        bool ok;
+
+        if ( in.first == 'c' )
+        {
+            corpora.emplace_back();
+            ok = load_corpus(in.second, corpora.back());
+        }
+        else
+        {
+            sets.emplace_back();
+            ok = (in.first == 'p') ?
+                load_patterns(in.second, sets.back()) : generate_patterns(in.second, sets.back());
+        }
+
+        if ( !ok )
+            return 1;
+    }
+
+    if ( sets.empty() )
+    {
+        // long, short, and mixed lengths at a few sizes
+        const char* suite[] = { "100:4:16", "1000:4:16", "10000:4:32", "1000:1:16", "10000:2:8" };
+
+        for ( auto spec : suite )
+        {
+            sets.emplace_back();
+            generate_patterns(spec, sets.back());
+        }
+    }
+
+    for ( auto& ps : sets )
+    {
+        if ( ps.pats.empty() )
+        {
+            fprintf(stderr, "no patterns in %s\n", ps.name.c_str());
+            return 1;
+        }
+    }
+
+    printf("%-20s %-16s %-10s %8s %10s %12s %6s %8s %12s %10s\n",
+        "patterns", "corpus", "method", "count", "compile_ms", "bytes", "dense", "ns/byte", "matches/s", "matches");
+
+    for ( auto& ps : sets )
+    {
+        vector<Corpus> gen;
+
+        if ( corpora.empty() )
+        {
+            gen.emplace_back();
+            generate_corpus(corpus_size, ps, gen.back());
+        }
+
+        for ( auto& c : corpora.empty() ? gen : corpora )
+        {
+            run_case(ps, c, KTRIE_METHOD_AUTO);
+            run_case(ps, c, KTRIE_METHOD_BC);
+            run_case(ps, c, KTRIE_METHOD_NOBC);
+        }
+
+        if ( updates )
+            run_update(ps);
+    }
+
+    return 0;
+}
@@ -28,9 +28,12 @@
 */
 // lowmem.cc author Russ Combs <rucombs@cisco.com>
 
+#include <string>
+
 #include "log/messages.h"
 #include "framework/module.h"
 #include "framework/mpse.h"
+#include "framework/mpse_batch.h"
 #include "main/snort_types.h"
 #include "profiler/profiler.h"
 
@@ -41,11 +44,34 @@ using namespace snort;
 #define MOD_NAME "lowmem"
 #define MOD_HELP "Keyword Trie (low memory, low performance) MPSE"
 
+// buffers handed to the trie per batched search call
+#define LM_BATCH_MAX 32
+
 struct BnfaCounts
 {
     PegCount searches;
     PegCount matches;
     PegCount bytes;
+    PegCount tries;
+    PegCount trie_patterns;
+    PegCount trie_nodes;
+    PegCount trie_bytes;
+    PegCount max_trie_bytes;
+    PegCount trie_images;
+    PegCount compile_usecs;
+    PegCount max_compile_usecs;
+    PegCount delete_usecs;
+    PegCount shared_tries;
+    PegCount walk_bytes;
+    PegCount prefix_attempts;
+    PegCount walk_steps;
+    PegCount kid_probes;
+    PegCount bc_shifts;
+    PegCount bc_shift_bytes;
+    PegCount max_walk_depth;
+    PegCount match_continue;
+    PegCount match_stop;
+    PegCount match_negative;
 };
 
 static THREAD_LOCAL BnfaCounts lm_counts;
@@ -56,6 +82,26 @@ const PegInfo lm_pegs[] =
     { CountType::SUM, "searches", "number of search attempts" },
     { CountType::SUM, "matches", "number of times a match was found" },
     { CountType::SUM, "bytes", "total bytes searched" },
+    { CountType::MAX, "tries", "number of compiled tries" },
+    { CountType::MAX, "trie_patterns", "number of patterns in all tries" },
+    { CountType::MAX, "trie_nodes", "number of nodes in all tries" },
+    { CountType::MAX, "trie_bytes", "memory used by all tries" },
+    { CountType::MAX, "max_trie_bytes", "memory used by the largest trie" },
+    { CountType::MAX, "trie_images", "number of tries mapped from cache_dir" },
+    { CountType::MAX, "compile_usecs", "total microseconds spent compiling tries" },
+    { CountType::MAX, "max_compile_usecs", "microseconds spent compiling the slowest trie" },
+    { CountType::MAX, "delete_usecs", "total microseconds spent deleting tries" },
+    { CountType::MAX, "shared_tries", "number of tries using a compiled trie shared with another" },
+    { CountType::MAX, "walk_bytes", "bytes searched with walk_stats" },
+    { CountType::MAX, "prefix_attempts", "positions where a trie walk was started" },
+    { CountType::MAX, "walk_steps", "trie nodes visited by walks" },
+    { CountType::MAX, "kid_probes", "edges compared finding the next node of a walk" },
+    { CountType::MAX, "bc_shifts", "bad character shifts taken" },
+    { CountType::MAX, "bc_shift_bytes", "bytes skipped by bad character shifts" },
+    { CountType::MAX, "max_walk_depth", "nodes visited by the longest walk" },
+    { CountType::MAX, "match_continue", "match callbacks that returned zero" },
+    { CountType::MAX, "match_stop", "match callbacks that returned positive to stop the walk" },
+    { CountType::MAX, "match_negative", "match callbacks that returned negative" },
 
     { CountType::END, nullptr, nullptr }
 };
@@ -64,10 +110,40 @@ const PegInfo lm_pegs[] =
 // module
 //-------------------------------------------------------------------------
 
+static const Parameter lm_params[] =
+{
+    { "compile_threads", Parameter::PT_INT, "0:max32", "1",
+      "threads used to build each trie (0 = one per cpu)" },
+
+    { "cache_dir", Parameter::PT_STRING, nullptr, nullptr,
+      "directory of compiled trie images shared by all runs with the same patterns" },
+
+    { "dense_levels", Parameter::PT_INT, "0:255", "0",
+      "trie levels whose wide nodes may get direct child tables (0 = none)" },
+
+    { "memory_budget", Parameter::PT_INT, "0:max53", "0",
+      "max bytes per trie when adding direct child tables (0 = no limit)" },
+
+    { "share", Parameter::PT_BOOL, nullptr, "true",
+      "use one compiled trie for groups with the same patterns, including across reloads" },
+
+    { "walk_stats", Parameter::PT_BOOL, nullptr, "false",
+      "count trie walk statistics (slows searches)" },
+
+    { nullptr, Parameter::PT_MAX, nullptr, nullptr, nullptr }
+};
+
 class LowmemModule : public Module
 {
 public:
-    LowmemModule() : Module(MOD_NAME, MOD_HELP) { }
+    LowmemModule() : Module(MOD_NAME, MOD_HELP, lm_params)
+    { begin(nullptr, 0, nullptr); }
+
+    bool begin(const char*, int, SnortConfig*) override;
+    bool set(const char*, Value&, SnortConfig*) override;
+
+    const KTRIE_CONFIG* get_config() const
+    { return &config; }
 
     ProfileStats* get_profile() const override
     { return &lm_stats; }
@@ -75,13 +151,87 @@ public:
     const PegInfo* get_pegs() const override
     { return lm_pegs; }
 
-    PegCount* get_counts() const override
-    { return (PegCount*)&lm_counts; }
+    PegCount* get_counts() const override;
 
     Usage get_usage() const override
     { return GLOBAL; }
+
+private:
+    KTRIE_CONFIG config;
+    std::string cache_dir;
 };
 
+// a reload starts from the defaults so removed parameters are not kept
+bool LowmemModule::begin(const char*, int, SnortConfig*)
+{
+    config = { };
+    config.compile_threads = 1;
+    config.share = true;
+    cache_dir.clear();
+    return true;
+}
+
+bool LowmemModule::set(const char*, Value& v, SnortConfig*)
+{
+    if ( v.is("compile_threads") )
+        config.compile_threads = v.get_uint32();
+
+    else if ( v.is("cache_dir") )
+    {
+        cache_dir = v.get_string();
+        config.cache_dir = cache_dir.empty() ? nullptr : cache_dir.c_str();
+    }
+
+    else if ( v.is("dense_levels") )
+        config.dense_levels = v.get_uint32();
+
+    else if ( v.is("memory_budget") )
+        config.memory_budget = v.get_size();
+
+    else if ( v.is("share") )
+        config.share = v.get_bool();
+
+    else if ( v.is("walk_stats") )
+        config.walk_stats = v.get_bool();
+
+    return true;
+}
+
+PegCount* LowmemModule::get_counts() const
+{
+    // memory totals are global; refresh this thread's copy
+    KTRIE_MEMSTATS ms;
+    KTrieGetMemStats(&ms);
+
+    lm_counts.tries = ms.tries;
+    lm_counts.trie_patterns = ms.patterns;
+    lm_counts.trie_nodes = ms.nodes;
+    lm_counts.trie_bytes = ms.bytes;
+    lm_counts.max_trie_bytes = ms.max_bytes;
+    lm_counts.trie_images = ms.images;
+    lm_counts.compile_usecs = ms.compile_usecs;
+    lm_counts.max_compile_usecs = ms.max_compile_usecs;
+    lm_counts.delete_usecs = ms.delete_usecs;
+    lm_counts.shared_tries = ms.shared;
+
+    // walk totals are also global
+    KTRIE_WALKSTATS ws;
+    KTrieGetWalkStats(&ws);
+
+    lm_counts.walk_bytes = ws.bytes;
+    lm_counts.prefix_attempts = ws.attempts;
+    lm_counts.walk_steps = ws.steps;
+    lm_counts.kid_probes = ws.probes;
+    lm_counts.bc_shifts = ws.shifts;
+    lm_counts.bc_shift_bytes = ws.shift_bytes;
+    lm_counts.max_walk_depth = ws.max_depth;
+    lm_counts.match_continue = ws.match_continue;
+    lm_counts.match_stop = ws.match_stop;
+    lm_counts.match_negative = ws.match_negative;
+
+    return (PegCount*)&lm_counts;
+}
+
 //-------------------------------------------------------------------------
 // mpse
 //-------------------------------------------------------------------------
@@ -92,8 +242,8 @@ private:
     KTRIE_STRUCT* obj;
 
 public:
-    LowmemMpse(const MpseAgent* agent) : Mpse("lowmem")
-    { obj = KTrieNew(0, agent); }
+    LowmemMpse(const MpseAgent* agent, const KTRIE_CONFIG* config) : Mpse("lowmem")
+    { obj = KTrieNew(0, agent, config); }
 
     ~LowmemMpse() override
     { KTrieDelete(obj); }
@@ -108,6 +258,7 @@ public:
     { return KTriePatternCount(obj); }
 
     int search(const uint8_t*, int, MpseMatch, void*, int*) override;
+    void search(MpseBatch&, MpseType) override;
 };
 
 int LowmemMpse::search(const uint8_t* T, int n, MpseMatch match, void* context, int* current_state)
@@ -124,6 +275,68 @@ int LowmemMpse::search(const uint8_t* T, int n, MpseMatch match, void* context,
     return found;
 }
 
+// buffers searched by lowmem groups are walked together so trie node
+// fetches overlap; buffers of other engines are searched as usual.
+// results are complete on return so the default receive_responses()
+// applies.
+void LowmemMpse::search(MpseBatch& batch, MpseType type)
+{
+    Profile profile(lm_stats);  // cppcheck-suppress unreadVariable
+
+    KTRIE_BATCH jobs[LM_BATCH_MAX];
+    MpseBatchItem* items[LM_BATCH_MAX];
+    unsigned njobs = 0;
+
+    auto flush = [&]()
+    {
+        KTrieSearchBatch(jobs, njobs, batch.mf, batch.context);
+
+        for ( unsigned i = 0; i < njobs; i++ )
+        {
+            items[i]->matches += jobs[i].nfound;
+            lm_counts.searches++;
+            lm_counts.bytes += jobs[i].n;
+            lm_counts.matches += jobs[i].nfound;
+        }
+        njobs = 0;
+    };
+
+    for ( auto& it : batch.items )
+    {
+        MpseBatchItem& item = it.second;
+
+        if ( item.done )
+            continue;
+
+        item.error = false;
+        item.matches = 0;
+
+        for ( auto* so : item.so )
+        {
+            Mpse* m = (type == MPSE_TYPE_NORMAL) ? so->get_normal_mpse() : so->get_offload_mpse();
+            LowmemMpse* lm = dynamic_cast<LowmemMpse*>(m);
+
+            if ( !lm )
+            {
+                int start_state = 0;
+                item.matches += m->search(
+                    it.first.buf, it.first.len, batch.mf, batch.context, &start_state);
+                continue;
+            }
+
+            if ( njobs == LM_BATCH_MAX )
+                flush();
+
+            jobs[njobs] = { lm->obj, it.first.buf, (int)it.first.len, 0 };
+            items[njobs++] = &item;
+        }
+        item.done = true;
+    }
+
+    if ( njobs )
+        flush();
+}
+
 //-------------------------------------------------------------------------
 // api
 //-------------------------------------------------------------------------
@@ -138,9 +351,10 @@ static void mod_dtor(Module* p)
     delete p;
 }
 
-static Mpse* lm_ctor(const SnortConfig*, class Module*, const MpseAgent* agent)
+static Mpse* lm_ctor(const SnortConfig*, class Module* m, const MpseAgent* agent)
 {
-    return new LowmemMpse(agent);
+    const KTRIE_CONFIG* config = m ? ((LowmemModule*)m)->get_config() : nullptr;
+    return new LowmemMpse(agent, config);
 }
 
 static void lm_dtor(Mpse* p)
@@ -151,7 +365,6 @@ static void lm_dtor(Mpse* p)
 static void lm_init()
 {
     KTrie_init_xlatcase();
-    KTrieInitMemUsed();
 }
 
 static void lm_print()
@@ -159,11 +372,49 @@ static void lm_print()
     if ( !KTrieMemUsed() )
         return;
 
-    double x = (double)KTrieMemUsed();
+    KTRIE_MEMSTATS ms;
+    KTrieGetMemStats(&ms);
+
+    double x = (double)ms.bytes;
 
     LogMessage("[ LowMem Search-Method Memory Used : %g %s ]\n",
         (x > 1.e+6) ?  x/1.e+6 : x/1.e+3,
         (x > 1.e+6) ? "MBytes" : "KBytes");
+
+    LogMessage("[ LowMem Search-Method Tries : " STDu64 ", Patterns : " STDu64
+        ", Nodes : " STDu64 ", Largest : " STDu64 " bytes ]\n",
+        ms.tries, ms.patterns, ms.nodes, ms.max_bytes);
+
+    if ( ms.images )
+        LogMessage("[ LowMem Search-Method Tries Mapped From Cache : " STDu64 " ]\n", ms.images);
+
+    if ( ms.shared )
+        LogMessage("[ LowMem Search-Method Tries Sharing A Compiled Trie : " STDu64 " ]\n", ms.shared);
+
+    LogMessage("[ LowMem Search-Method Compile Time : " STDu64 " usecs, Slowest : " STDu64 " usecs ]\n",
+        ms.compile_usecs, ms.max_compile_usecs);
+
+    // walk totals are kept from startup and not reset by reloads, so
+    // these include the searches done with the previous configurations
+    KTRIE_WALKSTATS ws;
+    KTrieGetWalkStats(&ws);
+
+    if ( !ws.bytes )
+        return;
+
+    LogMessage("[ LowMem Search-Method Walks : %.3f attempts/byte, %.2f nodes/attempt"
+        ", %.2f probes/node, max depth " STDu64 " ]\n",
+        (double)ws.attempts / ws.bytes,
+        ws.attempts ? (double)ws.steps / ws.attempts : 0.0,
+        ws.steps ? (double)ws.probes / ws.steps : 0.0,
+        ws.max_depth);
+
+    LogMessage("[ LowMem Search-Method Skips : " STDu64 ", %.2f bytes/skip ]\n",
+        ws.shifts, ws.shifts ? (double)ws.shift_bytes / ws.shifts : 0.0);
+
+    LogMessage("[ LowMem Search-Method Match Returns : " STDu64 " zero, " STDu64
+        " positive, " STDu64 " negative ]\n",
+        ws.match_continue, ws.match_stop, ws.match_negative);
 }
 
 static const MpseApi lm_api =
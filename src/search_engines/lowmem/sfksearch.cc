@@ -31,49 +31,252 @@
 
 #include "sfksearch.h"
 
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
 #include <cassert>
+#include <chrono>
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#if defined(__x86_64__) and (defined(__GNUC__) or defined(__clang__))
+#include <immintrin.h>
+#define KTRIE_VECTOR_SCAN
+#endif
 
 #include "main/thread.h"
 #include "utils/util.h"
 
-static void KTrieFree(KTRIENODE* n);
+/* insert patterns in parallel only when there are enough of them */
+#define KTRIE_MT_MIN_PATTERNS 1024
+
+/* number of buffers walked in lock step by a batched search */
+#define KTRIE_BATCH_LANES 8
+
+#if defined(__GNUC__) or defined(__clang__)
+#define KTRIE_PREFETCH(p) __builtin_prefetch(p)
+#else
+#define KTRIE_PREFETCH(p)
+#endif
+
+/* use the vector scan if at most 1 in 8 random positions survive */
+#define KTRIE_SCAN_MAX_PASS (KTRIE_ROOT_NODES * KTRIE_ROOT_NODES / 8)
 
-static unsigned int mtot = 0;
+/*
+*  Patterns shorter than this are too short for the bad character shift;
+*  the q-gram shift table skips on the longer ones instead, unless the
+*  short patterns start with so many different bytes that most positions
+*  would be walked anyway.
+*/
+#define KTRIE_WM_SHORT     3
+#define KTRIE_WM_MAX_SHORT 64
+#define KTRIE_WM_HASH      1024
+#define KTRIE_WM_MAX_SIZE  256   /* so shifts fit in a byte*/
 
-unsigned int KTrieMemUsed()
+#define KTRIE_WM_INDEX(a, b) \
+    ((((unsigned)xlatcase[a] << 2) ^ xlatcase[b]) & (KTRIE_WM_HASH - 1))
+
+/*
+*  Global totals over all tries - tries may be built and deleted by any
+*  thread so these are atomic.  Per trie totals are kept in the trie.
+*  They are never reset since tries of the previous configuration are
+*  still alive when a reload starts: the counts of tries, patterns,
+*  nodes, bytes, images and shared tries follow the live tries and the
+*  times and maxima accumulate from startup.
+*/
+static std::atomic<uint64_t> ttot { 0 };    /* tries*/
+static std::atomic<uint64_t> ptot { 0 };    /* patterns*/
+static std::atomic<uint64_t> ntot { 0 };    /* flattened nodes*/
+static std::atomic<uint64_t> mtot { 0 };    /* bytes*/
+static std::atomic<uint64_t> mmax { 0 };    /* bytes of largest trie*/
+static std::atomic<uint64_t> itot { 0 };    /* tries mapped from images*/
+static std::atomic<uint64_t> ctot { 0 };    /* usecs compiling*/
+static std::atomic<uint64_t> cmax { 0 };    /* usecs of slowest compile*/
+static std::atomic<uint64_t> dtot { 0 };    /* usecs deleting*/
+static std::atomic<uint64_t> stot { 0 };    /* tries reusing a shared image*/
+
+typedef std::chrono::steady_clock KTrieClock;
+
+/* walk totals, added to at the end of each instrumented search */
+struct KTRIEWALKTOT
+{
+    std::atomic<uint64_t> bytes { 0 };
+    std::atomic<uint64_t> attempts { 0 };
+    std::atomic<uint64_t> steps { 0 };
+    std::atomic<uint64_t> probes { 0 };
+    std::atomic<uint64_t> shifts { 0 };
+    std::atomic<uint64_t> shift_bytes { 0 };
+    std::atomic<uint64_t> max_depth { 0 };
+
+    std::atomic<uint64_t> match_continue { 0 };
+    std::atomic<uint64_t> match_stop { 0 };
+    std::atomic<uint64_t> match_negative { 0 };
+};
+
+static KTRIEWALKTOT wtot;
+
+uint64_t KTrieMemUsed()
 {
     return mtot;
 }
 
-void KTrieInitMemUsed()
+void KTrieGetMemStats(KTRIE_MEMSTATS* ms)
 {
-    mtot = 0;
+    ms->tries = ttot;
+    ms->patterns = ptot;
+    ms->nodes = ntot;
+    ms->bytes = mtot;
+    ms->max_bytes = mmax;
+    ms->images = itot;
+    ms->compile_usecs = ctot;
+    ms->max_compile_usecs = cmax;
+    ms->delete_usecs = dtot;
+    ms->shared = stot;
 }
 
-/*
-*  Allocate Memory
-*/
-static void* KTRIE_MALLOC(int n)
+void KTrieGetWalkStats(KTRIE_WALKSTATS* ws)
 {
-    assert(n > 0);
-    void* p = snort_calloc(n);
+    ws->bytes = wtot.bytes;
+    ws->attempts = wtot.attempts;
+    ws->steps = wtot.steps;
+    ws->probes = wtot.probes;
+    ws->shifts = wtot.shifts;
+    ws->shift_bytes = wtot.shift_bytes;
+    ws->max_depth = wtot.max_depth;
+    ws->match_continue = wtot.match_continue;
+    ws->match_stop = wtot.match_stop;
+    ws->match_negative = wtot.match_negative;
+}
+
+static void KTrieCharge(size_t* memory, size_t n)
+{
+    *memory += n;
     mtot += n;
-    return p;
+}
+
+static void KTrieRelease(size_t* memory, size_t n)
+{
+    assert(*memory >= n);
+    *memory -= n;
+    mtot -= n;
+}
+
+static void KTrieAtomicMax(std::atomic<uint64_t>& max, uint64_t val)
+{
+    uint64_t cur = max;
+
+    while ( val > cur and !max.compare_exchange_weak(cur, val) )
+        ;
+}
+
+static void KTrieUpdateMax(const KTRIE_STRUCT* ts)
+{
+    KTrieAtomicMax(mmax, ts->memory);
+}
+
+static uint64_t KTrieUsecs(KTrieClock::time_point start)
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>(KTrieClock::now() - start).count();
+}
+
+#define KTRIE_HASH_INIT 14695981039346656037ULL
+#define KTRIE_HASH_MULT 1099511628211ULL
+
+static inline uint64_t KTrieHash(uint64_t h, const void* v, size_t n)
+{
+    const uint8_t* b = (const uint8_t*)v;
+
+    /* FNV-1a */
+    while ( n-- )
+        h = (h ^ *b++) * KTRIE_HASH_MULT;
+
+    return h;
 }
 
 /*
-*  Free Memory
+*  Arena chunks start small so tries with few patterns stay small and
+*  double up to the max.  Large blocks get a dedicated chunk.
 */
-static void KTRIE_FREE(void* p)
+#define KTRIE_CHUNK_MIN  (1024)
+#define KTRIE_CHUNK_MAX  (64*1024)
+
+/*
+*  Allocate Memory - zeroed, 8 byte aligned
+*/
+static void* KTRIE_MALLOC(size_t* memory, KTRIECHUNK** arena, unsigned n)
 {
-    if ( p )
-        snort_free(p);
+    assert(n > 0);
+    n = (n + 7) & ~7u;
+
+    KTRIECHUNK* c = *arena;
+
+    if ( !c or c->used + n > c->size )
+    {
+        unsigned size = c ? 2 * c->size : KTRIE_CHUNK_MIN;
+
+        if ( size > KTRIE_CHUNK_MAX )
+            size = KTRIE_CHUNK_MAX;
+
+        KTRIECHUNK* nc;
+
+        if ( n > size / 2 )
+        {
+            nc = (KTRIECHUNK*)snort_calloc(sizeof(*nc) + n);
+            nc->size = nc->used = n;
+            KTrieCharge(memory, sizeof(*nc) + n);
+
+            /* keep filling the current chunk */
+            if ( c )
+            {
+                nc->next = c->next;
+                c->next = nc;
+            }
+            else
+                *arena = nc;
+
+            return nc + 1;
+        }
+
+        nc = (KTRIECHUNK*)snort_calloc(sizeof(*nc) + size);
+        nc->size = size;
+        nc->next = c;
+        KTrieCharge(memory, sizeof(*nc) + size);
+
+        *arena = c = nc;
+    }
+
+    void* p = (uint8_t*)(c + 1) + c->used;
+    c->used += n;
+
+    return p;
 }
 
 /*
-*   Local/Tmp nocase array
+*  Free Memory - releases the whole arena
 */
-static THREAD_LOCAL uint8_t Tnocase[65*1024];
+static void KTRIE_FREE(size_t* memory, KTRIECHUNK** arena)
+{
+    KTRIECHUNK* c = *arena;
+
+    while ( c )
+    {
+        KTRIECHUNK* cnext = c->next;
+        KTrieRelease(memory, sizeof(*c) + c->size);
+        snort_free(c);
+        c = cnext;
+    }
+    *arena = nullptr;
+}
 
 /*
 ** Case Translation Table
@@ -106,17 +309,24 @@ static inline void ConvertCaseEx(uint8_t* d, const uint8_t* s, int m)
 /*
 *
 */
-KTRIE_STRUCT* KTrieNew(int method, const MpseAgent* agent)
+KTRIE_STRUCT* KTrieNew(int method, const MpseAgent* agent, const KTRIE_CONFIG* config)
 {
-    KTRIE_STRUCT* ts = (KTRIE_STRUCT*)KTRIE_MALLOC(sizeof(*ts));
+    KTRIE_STRUCT* ts = (KTRIE_STRUCT*)snort_calloc(sizeof(*ts));
+
+    KTrieCharge(&ts->memory, sizeof(*ts));
+    ttot++;
 
-    ts->memory = sizeof(*ts);
     ts->nchars = 0;
     ts->npats  = 0;
     ts->end_states = 0;
-    ts->method = method; /* - old method, 1 = queue */
+    ts->method = method;
     ts->agent = agent;
 
+    if ( config )
+        ts->config = *config;
+    else
+        ts->config.compile_threads = 1;
+
     return ts;
 }
 
@@ -125,15 +335,159 @@ int KTriePatternCount(KTRIE_STRUCT* k)
     return k->npats;
 }
 
+/*
+*  Pattern string interning - each distinct string is kept once in the
+*  arena so duplicate keywords, and the nocase and exact copies of a
+*  pattern without upper case, share it.  The index is open addressed
+*  and only needed while patterns are added; KTrieCompile drops it and
+*  it is rebuilt from the pattern list if more are added later.
+*/
+#define KTRIE_INTERN_MIN 64
+
+static void KTrieInternFree(KTRIE_STRUCT* ts)
+{
+    if ( !ts->intern )
+        return;
+
+    KTrieRelease(&ts->memory, ts->intern_size * sizeof(KTRIEINTERN));
+    snort_free(ts->intern);
+
+    ts->intern = nullptr;
+    ts->intern_size = ts->intern_count = 0;
+}
+
+static void KTrieInternAdd(KTRIE_STRUCT* ts, uint8_t* s, uint32_t n, uint32_t hash)
+{
+    unsigned mask = ts->intern_size - 1;
+    unsigned i = hash & mask;
+
+    while ( ts->intern[i].s )
+        i = (i + 1) & mask;
+
+    ts->intern[i] = { s, n, hash };
+    ts->intern_count++;
+}
+
+static inline uint32_t KTrieInternHash(const uint8_t* P, unsigned n, bool fold)
+{
+    uint64_t h = KTRIE_HASH_INIT;
+
+    while ( n-- )
+        h = (h ^ (fold ? xlatcase[*P++] : *P++)) * KTRIE_HASH_MULT;
+
+    return (uint32_t)(h ^ (h >> 32));
+}
+
+static inline bool KTrieInternSame(const uint8_t* s, const uint8_t* P, unsigned n, bool fold)
+{
+    if ( !fold )
+        return !memcmp(s, P, n);
+
+    for ( unsigned k = 0; k < n; k++ )
+    {
+        if ( s[k] != xlatcase[P[k]] )
+            return false;
+    }
+    return true;
+}
+
+static uint8_t* KTrieInternFind(
+    const KTRIE_STRUCT* ts, const uint8_t* P, unsigned n, uint32_t hash, bool fold)
+{
+    unsigned mask = ts->intern_size - 1;
+
+    for ( unsigned i = hash & mask; ts->intern[i].s; i = (i + 1) & mask )
+    {
+        const KTRIEINTERN* e = ts->intern + i;
+
+        if ( e->hash == hash and e->n == n and KTrieInternSame(e->s, P, n, fold) )
+            return e->s;
+    }
+    return nullptr;
+}
+
+static void KTrieInternGrow(KTRIE_STRUCT* ts)
+{
+    KTRIEINTERN* old = ts->intern;
+    unsigned old_size = ts->intern_size;
+    unsigned size = old_size ? 2 * old_size : KTRIE_INTERN_MIN;
+
+    /* make room to index the strings of patterns added before compiling */
+    if ( !old )
+    {
+        while ( size < 4 * (unsigned)ts->npats )
+            size *= 2;
+    }
+
+    ts->intern = (KTRIEINTERN*)snort_calloc(size * sizeof(KTRIEINTERN));
+    ts->intern_size = size;
+    ts->intern_count = 0;
+    KTrieCharge(&ts->memory, size * sizeof(KTRIEINTERN));
+
+    if ( old )
+    {
+        for ( unsigned i = 0; i < old_size; i++ )
+        {
+            if ( old[i].s )
+                KTrieInternAdd(ts, old[i].s, old[i].n, old[i].hash);
+        }
+        KTrieRelease(&ts->memory, old_size * sizeof(KTRIEINTERN));
+        snort_free(old);
+        return;
+    }
+
+    for ( KTRIEPATTERN* p = ts->patrn; p; p = p->next )
+    {
+        uint8_t* v[2] = { p->P, p->Pcase };
+
+        for ( auto str : v )
+        {
+            uint32_t hash = KTrieInternHash(str, p->n, false);
+
+            if ( !KTrieInternFind(ts, str, p->n, hash, false) )
+                KTrieInternAdd(ts, str, p->n, hash);
+        }
+    }
+}
+
+/*
+*  Get the interned copy of P, case folded if fold
+*/
+static uint8_t* KTrieIntern(KTRIE_STRUCT* ts, const uint8_t* P, unsigned n, bool fold)
+{
+    if ( (ts->intern_count + 1) * 2 > ts->intern_size )
+        KTrieInternGrow(ts);
+
+    uint32_t hash = KTrieInternHash(P, n, fold);
+    uint8_t* s = KTrieInternFind(ts, P, n, hash, fold);
+
+    if ( s )
+        return s;
+
+    s = (uint8_t*)KTRIE_MALLOC(&ts->memory, &ts->mem, n);
+
+    if ( fold )
+        ConvertCaseEx(s, P, n);
+    else
+        memcpy(s, P, n);
+
+    KTrieInternAdd(ts, s, n, hash);
+    return s;
+}
+
 /*
  * Deletes memory that was used in creating trie
  * and nodes
  */
+static void KTrieUnshare(uint64_t hash);
+
 void KTrieDelete(KTRIE_STRUCT* k)
 {
     if ( !k )
         return;
 
+    KTrieClock::time_point start = KTrieClock::now();
+
     KTRIEPATTERN* p = k->patrn;
     KTRIEPATTERN* pnext = nullptr;
 
@@ -151,51 +505,60 @@ void KTrieDelete(KTRIE_STRUCT* k)
                 k->agent->list_free(&p->neg_list);
         }
 
-        KTRIE_FREE(p->P);
-        KTRIE_FREE(p->Pcase);
-        KTRIE_FREE(p);
-
         p = pnext;
     }
 
-    for ( int i = 0; i < KTRIE_ROOT_NODES; i++ )
-        KTrieFree(k->root[i]);
+    KTrieInternFree(k);
 
-    KTRIE_FREE(k);
-}
+    /* patterns, nodes, and flattened trie all live in the arenas */
+    KTRIE_FREE(&k->memory, &k->nodemem);
+    KTRIE_FREE(&k->memory, &k->flatmem);
+    KTRIE_FREE(&k->memory, &k->mem);
 
-/*
- * Recursively delete all nodes in trie
- */
-static void KTrieFree(KTRIENODE* n)
-{
-    if ( !n )
-        return;
+    if ( k->image_shared )
+        KTrieUnshare(k->image_hash);
+
+    else if ( k->image )
+        munmap(k->image, k->image_size);
+
+    if ( k->image_loaded )
+        itot--;
+
+    KTrieRelease(&k->memory, sizeof(*k));
+    assert(!k->memory);
+
+    ttot--;
+    ptot -= k->npats;
+    ntot -= k->fnodes ? k->fnodes - 1 : 0;
 
-    KTrieFree(n->child);
-    KTrieFree(n->sibling);
+    snort_free(k);
 
-    KTRIE_FREE(n);
+    dtot += KTrieUsecs(start);
 }
 
 /*
 *
 */
-static KTRIEPATTERN* KTrieNewPattern(const uint8_t* P, unsigned n)
+static KTRIEPATTERN* KTrieNewPattern(KTRIE_STRUCT* ts, const uint8_t* P, unsigned n)
 {
     if (n < 1)
         return nullptr;
 
-    KTRIEPATTERN* p = (KTRIEPATTERN*)KTRIE_MALLOC(sizeof(*p));
+    KTRIEPATTERN* p = ts->patfree;
 
-    /* Save as a nocase string */
-    p->P = (uint8_t*)KTRIE_MALLOC(n);
+    if ( p )
+    {
+        ts->patfree = p->next;
+        memset(p, 0, sizeof(*p));
+    }
+    else
+        p = (KTRIEPATTERN*)KTRIE_MALLOC(&ts->memory, &ts->mem, sizeof(*p));
 
-    ConvertCaseEx(p->P, P, n);
+    /* Save as a nocase string */
+    p->P = KTrieIntern(ts, P, n, true);
 
     /* Save Case specific version */
-    p->Pcase = (uint8_t*)KTRIE_MALLOC(n);
-    memcpy(p->Pcase, P, n);
+    p->Pcase = KTrieIntern(ts, P, n, false);
 
     p->n = n;
     p->next = nullptr;
@@ -214,14 +577,14 @@ int KTrieAddPattern(
 
     if ( !ts->patrn )
     {
-        pnew = ts->patrn = KTrieNewPattern(P, n);
+        pnew = ts->patrn = KTrieNewPattern(ts, P, n);
 
         if ( !pnew )
             return -1;
     }
     else
     {
-        pnew = KTrieNewPattern(P, n);
+        pnew = KTrieNewPattern(ts, P, n);
 
         if ( !pnew )
             return -1;
@@ -236,43 +599,83 @@ int KTrieAddPattern(
     pnew->user = user;
     pnew->mnext = nullptr;
 
+    /* added to a compiled trie, KTrieUpdate inserts it */
+    if ( ts->fnode )
+        pnew->pending = KTRIE_PENDING_INSERT;
+
+    if ( !nocase )
+        ts->ncase++;
+
     ts->npats++;
-    ts->memory += sizeof(KTRIEPATTERN) + 2 * n;  /* Case and nocase */
+    ptot++;
 
     return 0;
 }
 
+/*
+*  Arena of what KTrieUpdate rebuilds each time.  Otherwise these live
+*  with the patterns since flatmem is released when the trie is shared.
+*/
+static inline KTRIECHUNK** KTrieBuildArena(KTRIE_STRUCT* ts)
+{
+    return ts->config.incremental ? &ts->flatmem : &ts->mem;
+}
+
+/*
+*  Insertion state - the linked nodes and counts of one compile thread
+*/
+struct KTRIEBUILD
+{
+    KTRIECHUNK* nodemem = nullptr;
+    KTRIENODE* nodefree = nullptr;  /* reused before nodemem*/
+    size_t memory = 0;
+
+    int nchars = 0;
+    int duplicates = 0;
+    int end_states = 0;
+};
+
 /*
 *
 */
-static KTRIENODE* KTrieCreateNode(KTRIE_STRUCT* ts)
+static KTRIENODE* KTrieCreateNode(KTRIEBUILD* b)
 {
-    KTRIENODE* t = (KTRIENODE*)KTRIE_MALLOC(sizeof(*t));
-    ts->memory += sizeof(*t);
+    KTRIENODE* t = b->nodefree;
+
+    if ( !t )
+        return (KTRIENODE*)KTRIE_MALLOC(&b->memory, &b->nodemem, sizeof(KTRIENODE));
+
+    b->nodefree = t->sibling;
+    memset(t, 0, sizeof(*t));
+
     return t;
 }
 
 /*
-*  Insert a Pattern in the Trie
+*  Insert a Pattern in the Trie - case sensitive patterns go in a
+*  separate trie keyed on the exact bytes so their matches are exact.
+*  Only the root slot of the pattern's 1st byte is touched so patterns
+*  with different roots may be inserted concurrently.
 */
-static int KTrieInsert(KTRIE_STRUCT* ts, KTRIEPATTERN* px)
+static int KTrieInsert(KTRIE_STRUCT* ts, KTRIEBUILD* b, KTRIEPATTERN* px)
 {
     int type = 0;
     int n = px->n;
-    uint8_t* P = px->P;
+    uint8_t* P = px->nocase ? px->P : px->Pcase;
+    KTRIENODE** roots = px->nocase ? ts->root : ts->croot;
     KTRIENODE* root;
 
     /* Make sure we at least have a root character for the tree */
-    if ( !ts->root[*P] )
+    if ( !roots[*P] )
     {
-        ts->root[*P] = root = KTrieCreateNode(ts);
+        roots[*P] = root = KTrieCreateNode(b);
         if ( !root )
             return -1;
         root->edge = *P;
     }
     else
     {
-        root = ts->root[*P];
+        root = roots[*P];
     }
 
     /* Walk existing Patterns */
@@ -317,28 +720,28 @@ static int KTrieInsert(KTRIE_STRUCT* ts, KTRIEPATTERN* px)
             /*
             *  Start with a new child to finish this Keyword
             */
-            root->child= KTrieCreateNode(ts);
+            root->child= KTrieCreateNode(b);
             if ( !root->child )
                 return -1;
             root=root->child;
             root->edge  = *P;
             P++;
             n--;
-            ts->nchars++;
+            b->nchars++;
         }
         else
         {
             /*
             *  Start a new sibling branch to finish this Keyword
             */
-            root->sibling= KTrieCreateNode(ts);
+            root->sibling= KTrieCreateNode(b);
             if ( !root->sibling )
                 return -1;
             root=root->sibling;
             root->edge  = *P;
             P++;
             n--;
-            ts->nchars++;
+            b->nchars++;
         }
     }
 
@@ -347,26 +750,26 @@ static int KTrieInsert(KTRIE_STRUCT* ts, KTRIEPATTERN* px)
     */
     while ( n )
     {
-        root->child = KTrieCreateNode(ts);
+        root->child = KTrieCreateNode(b);
         if ( !root->child )
             return -1;
         root=root->child;
         root->edge  = *P;
         P++;
         n--;
-        ts->nchars++;
+        b->nchars++;
     }
 
     if ( root->pkeyword )
     {
         px->mnext = root->pkeyword;  /* insert duplicates at front of list */
         root->pkeyword = px;
-        ts->duplicates++;
+        b->duplicates++;
     }
     else
     {
         root->pkeyword = px;
-        ts->end_states++;
+        b->end_states++;
     }
 
     return 0;
@@ -381,6 +784,7 @@ static void Build_Bad_Character_Shifts(KTRIE_STRUCT* kt)
 
     /* Calc the min pattern size */
     kt->bcSize = 32000;
+    kt->maxSize = 0;
 
     for ( plist=kt->patrn; plist; plist=plist->next )
     {
@@ -388,6 +792,10 @@ static void Build_Bad_Character_Shifts(KTRIE_STRUCT* kt)
         {
             kt->bcSize = plist->n; /* smallest pattern size */
         }
+        if ( plist->n > kt->maxSize )
+        {
+            kt->maxSize = plist->n;
+        }
     }
 
     /*
@@ -414,52 +822,82 @@ static void Build_Bad_Character_Shifts(KTRIE_STRUCT* kt)
             }
         }
     }
+
+    /*
+    *  Fold case into the table so the text needn't be converted
+    */
+    for ( int i = 0; i < KTRIE_ROOT_NODES; i++ )
+    {
+        kt->bcShift[i] = kt->bcShift[ xlatcase[i] ];
+    }
 }
 
-static int KTrieBuildMatchStateNode(
-    snort::SnortConfig* sc, KTRIENODE* root, KTRIE_STRUCT* ts)
+/*
+*  Build the rule option tree and negated list of a match list on
+*  its 1st pattern
+*/
+static int KTrieBuildMatchState(
+    snort::SnortConfig* sc, KTRIEPATTERN* pkeyword, KTRIE_STRUCT* ts)
 {
     int cnt = 0;
-    KTRIEPATTERN* p;
 
-    if (!root)
-        return 0;
-
-    /* each and every prefix match at this root*/
-    if (root->pkeyword)
+    for (KTRIEPATTERN* p = pkeyword; p; p = p->mnext)
     {
-        for (p = root->pkeyword; p; p = p->mnext)
+        if (p->user)
         {
-            if (p->user)
+            if (p->negative)
             {
-                if (p->negative)
-                {
-                    ts->agent->negate_list(p->user, &root->pkeyword->neg_list);
-                }
-                else
-                {
-                    ts->agent->build_tree(sc, p->user, &root->pkeyword->rule_option_tree);
-                }
+                ts->agent->negate_list(p->user, &pkeyword->neg_list);
+            }
+            else
+            {
+                ts->agent->build_tree(sc, p->user, &pkeyword->rule_option_tree);
             }
-
-            cnt++;
         }
 
-        /* Last call to finalize the tree for this root */
-        ts->agent->build_tree(sc, nullptr, &root->pkeyword->rule_option_tree);
+        cnt++;
     }
 
-    /* for child of this root */
-    if (root->child)
-    {
-        cnt += KTrieBuildMatchStateNode(sc, root->child, ts);
-    }
+    /* Last call to finalize the tree for this root */
+    ts->agent->build_tree(sc, nullptr, &pkeyword->rule_option_tree);
+
+    return cnt;
+}
+
+/*
+*  Visit the nodes under root depth first, children before siblings.
+*  The explicit stack holds at most one entry per level plus the
+*  pending siblings so long patterns and wide nodes can't exhaust the
+*  thread stack.
+*/
+static int KTrieBuildMatchStateNode(
+    snort::SnortConfig* sc, KTRIENODE* root, KTRIE_STRUCT* ts,
+    std::vector<KTRIENODE*>& stack)
+{
+    int cnt = 0;
+
+    stack.clear();
 
-    /* 1st sibling of this root -- other siblings will be processed from
-     * within the processing for root->sibling. */
-    if (root->sibling)
+    if (root)
+        stack.push_back(root);
+
+    while ( !stack.empty() )
     {
-        cnt += KTrieBuildMatchStateNode(sc, root->sibling, ts);
+        KTRIENODE* t = stack.back();
+        stack.pop_back();
+
+        /* each and every prefix match at this node*/
+        if (t->pkeyword)
+        {
+            cnt += KTrieBuildMatchState(sc, t->pkeyword, ts);
+        }
+
+        /* the sibling is visited after the child's subtree */
+        if (t->sibling)
+            stack.push_back(t->sibling);
+
+        if (t->child)
+            stack.push_back(t->child);
     }
 
     return cnt;
@@ -468,16 +906,18 @@ static int KTrieBuildMatchStateNode(
 static int KTrieBuildMatchStateTrees(snort::SnortConfig* sc, KTRIE_STRUCT* ts)
 {
     int cnt = 0;
+    std::vector<KTRIENODE*> stack;
 
     /* Find the states that have a MatchList */
-    for (int i = 0; i < KTRIE_ROOT_NODES; i++)
+    for (int i = 0; i < 2 * KTRIE_ROOT_NODES; i++)
     {
-        KTRIENODE* root = ts->root[i];
+        KTRIENODE* root = (i < KTRIE_ROOT_NODES) ?
+            ts->root[i] : ts->croot[i - KTRIE_ROOT_NODES];
 
         /* each and every prefix match at this root*/
         if ( root and ts->agent )
         {
-            cnt += KTrieBuildMatchStateNode(sc, root, ts);
+            cnt += KTrieBuildMatchStateNode(sc, root, ts, stack);
         }
     }
 
@@ -485,145 +925,1658 @@ static int KTrieBuildMatchStateTrees(snort::SnortConfig* sc, KTRIE_STRUCT* ts)
 }
 
 /*
-*  Build the Keyword TRIE
-*
+*  Collect the children of a node sorted by edge
 */
-static inline int _KTrieCompile(KTRIE_STRUCT* ts)
+static void KTrieSortKids(KTRIENODE* root, std::vector<KTRIENODE*>& kids)
 {
-    KTRIEPATTERN* p;
-    /*
-    static int  tmem=0;  // unused
-    */
+    kids.clear();
 
-    /*
-    *    Build the Keyword TRIE
-    */
-    for ( p=ts->patrn; p; p=p->next )
+    for ( KTRIENODE* k = root->child; k; k = k->sibling )
     {
-        if ( KTrieInsert(ts, p) )
-            return -1;
+        unsigned i = kids.size();
+        kids.push_back(k);
+
+        while ( i > 0 and kids[i-1]->edge > k->edge )
+        {
+            kids[i] = kids[i-1];
+            i--;
+        }
+        kids[i] = k;
     }
+}
 
-    /*
-    *    Build A Setwise Bad Character Shift Table
-    */
-    Build_Bad_Character_Shifts(ts);
+/*
+*  Convert the linked trie into a single array of nodes.  Nodes are laid
+*  out breadth first so that the children of each node are contiguous.
+*/
+static int KTrieFlatten(KTRIE_STRUCT* ts)
+{
+    std::vector<KTRIENODE*> queue;
+    std::vector<KTRIENODE*> kids;
 
-    /*
-    tmem += ts->memory;
-    printf(" Compile stats: %d patterns, %d chars, %d duplicate patterns, %d bytes, %d total-bytes\n",ts->npats,ts->nchars,ts->duplicates,ts->memory,tmem);
-    */
+    for ( int i = 0; i < KTRIE_ROOT_NODES; i++ )
+    {
+        if ( ts->root[i] )
+            queue.push_back(ts->root[i]);
 
-    return 0;
-}
+        if ( ts->croot[i] )
+            queue.push_back(ts->croot[i]);
+    }
 
-int KTrieCompile(snort::SnortConfig* sc, KTRIE_STRUCT* ts)
-{
-    int rval;
+    /* count nodes and match lists */
+    uint32_t nmatch = 0;
 
-    if ((rval = _KTrieCompile(ts)))
-        return rval;
+    for ( unsigned q = 0; q < queue.size(); q++ )
+    {
+        KTRIENODE* t = queue[q];
 
-    if ( ts->agent )
-        KTrieBuildMatchStateTrees(sc, ts);
+        if ( t->pkeyword )
+            nmatch++;
 
-    return 0;
-}
+        for ( KTRIENODE* k = t->child; k; k = k->sibling )
+            queue.push_back(k);
+    }
 
-void sfksearch_print_qinfo()
-{
-}
+    ts->fnodes = queue.size() + 1;
+    ts->fmatches = nmatch;
 
-/*
-*   Search - Algorithm
-*
-*   This routine will log any substring of T that matches a keyword,
-*   and processes all prefix matches. This is used for generic
-*   pattern searching with a set of keywords and a body of text.
-*
-*
+    ts->fnode = (KTRIEFNODE*)KTRIE_MALLOC(&ts->memory, &ts->flatmem, ts->fnodes * sizeof(KTRIEFNODE));
+    ts->fedge = (uint8_t*)KTRIE_MALLOC(&ts->memory, &ts->flatmem, ts->fnodes);
+    ts->fmatch = (KTRIEPATTERN**)KTRIE_MALLOC(
+        &ts->memory, KTrieBuildArena(ts), (nmatch + 1) * sizeof(KTRIEPATTERN*));
+
+    ntot += ts->fnodes - 1;
+
+    /* assign indices breadth first, roots first */
+    queue.clear();
+
+    for ( int i = 0; i < KTRIE_ROOT_NODES; i++ )
+    {
+        if ( ts->root[i] )
+        {
+            queue.push_back(ts->root[i]);
+            ts->froot[i] = queue.size();
+        }
+    }
+
+    for ( int i = 0; i < KTRIE_ROOT_NODES; i++ )
+    {
+        if ( ts->croot[i] )
+        {
+            queue.push_back(ts->croot[i]);
+            ts->fcroot[i] = queue.size();
+        }
+    }
+
+    /* nocase roots are reached by either case of the 1st character */
+    for ( int i = 0; i < KTRIE_ROOT_NODES; i++ )
+        ts->froot[i] = ts->froot[ xlatcase[i] ];
+
+    nmatch = 0;
+
+    for ( unsigned q = 0; q < queue.size(); q++ )
+    {
+        KTRIENODE* t = queue[q];
+        KTRIEFNODE* f = ts->fnode + q + 1;
+
+        ts->fedge[q + 1] = (uint8_t)t->edge;
+
+        if ( t->pkeyword )
+        {
+            ts->fmatch[nmatch++] = t->pkeyword;
+            f->match = nmatch;
+        }
+
+        KTrieSortKids(t, kids);
+
+        if ( kids.empty() )
+            continue;
+
+        f->kids = queue.size() + 1;
+        f->nkids = kids.size();
+
+        for ( unsigned k = 0; k < kids.size(); k++ )
+        {
+            if ( k < KTRIE_INLINE_KIDS )
+                f->edge[k] = (uint8_t)kids[k]->edge;
+
+            queue.push_back(kids[k]);
+        }
+    }
+
+    /* the linked nodes are no longer needed unless updating */
+    if ( ts->config.incremental )
+        return 0;
+
+    for ( int i = 0; i < KTRIE_ROOT_NODES; i++ )
+    {
+        ts->root[i] = nullptr;
+        ts->croot[i] = nullptr;
+    }
+    KTRIE_FREE(&ts->memory, &ts->nodemem);
+
+    return 0;
+}
+
+/*
+*  Give the widest nodes near the root direct child tables.  Candidates
+*  are nodes too wide for inline edges in the first dense_levels levels,
+*  taken shallowest and widest first while the trie stays within
+*  memory_budget.  A table maps each byte to 1 + the offset of the child
+*  or 0.  Nodes with all 256 children are indexed directly already.
+*/
+static void KTrieBuildDense(KTRIE_STRUCT* ts)
+{
+    ts->fdense = nullptr;
+    ts->fdenses = 0;
+
+    if ( !ts->config.dense_levels )
+        return;
+
+    std::vector<uint8_t> depth(ts->fnodes, 0);
+    std::vector<uint32_t> cand;
+
+    /* children always follow their parent so one pass sets all depths */
+    for ( uint32_t i = 1; i < ts->fnodes; i++ )
+    {
+        const KTRIEFNODE* f = ts->fnode + i;
+
+        for ( unsigned k = 0; k < f->nkids; k++ )
+            depth[f->kids + k] = depth[i] < UINT8_MAX ? depth[i] + 1 : UINT8_MAX;
+
+        if ( f->nkids > KTRIE_INLINE_KIDS and f->nkids < KTRIE_ROOT_NODES and
+            depth[i] < ts->config.dense_levels )
+            cand.push_back(i);
+    }
+
+    std::sort(cand.begin(), cand.end(),
+        [&](uint32_t a, uint32_t b)
+        {
+            if ( depth[a] != depth[b] )
+                return depth[a] < depth[b];
+
+            if ( ts->fnode[a].nkids != ts->fnode[b].nkids )
+                return ts->fnode[a].nkids > ts->fnode[b].nkids;
+
+            return a < b;
+        });
+
+    size_t budget = ts->config.memory_budget;
+    uint32_t n = 0;
+
+    while ( n < cand.size() and
+        (!budget or ts->memory + (n + 1) * KTRIE_ROOT_NODES <= budget) )
+        n++;
+
+    if ( !n )
+        return;
+
+    ts->fdense = (uint8_t*)KTRIE_MALLOC(&ts->memory, &ts->flatmem, n * KTRIE_ROOT_NODES);
+    ts->fdenses = n;
+
+    for ( uint32_t d = 0; d < n; d++ )
+    {
+        KTRIEFNODE* f = ts->fnode + cand[d];
+        uint8_t* table = ts->fdense + d * KTRIE_ROOT_NODES;
+
+        for ( unsigned k = 0; k < f->nkids; k++ )
+            table[ ts->fedge[f->kids + k] ] = (uint8_t)(k + 1);
+
+        f->nkids |= KTRIE_DENSE;
+        memcpy(f->edge + 2, &d, sizeof(d));
+    }
+}
+
+/*
+*  Build the Keyword TRIE
 *
-*   kt- Trie Structure
-*   T - nocase text
-*   Tc- case specific text
-*   n - text length
+*/
+/*
+*  Vector scan - each block of 16 or 32 text positions is tested at once
+*  against bitmaps of the 1st and 2nd bytes of all patterns using nibble
+*  lookups (pshufb).  Only the surviving positions are handed to the trie.
+*/
+#define KTRIE_BIT_SET(m, c) ((m)[(c) >> 3] & (1 << ((c) & 7)))
+
+static void Build_Scan_Set(uint8_t* set, uint8_t* mask, uint8_t c)
+{
+    set[c >> 3] |= (uint8_t)(1 << (c & 7));
+
+    /* low nibble indexes the table, high nibble selects the bit */
+    mask[(c & 0x80 ? 16 : 0) + (c & 0xf)] |= (uint8_t)(1 << ((c >> 4) & 7));
+}
+
+static inline const uint8_t* KTrieScanTail(
+    const KTRIE_STRUCT* ks, const uint8_t* T, const uint8_t* Tend)
+{
+    /* T[1] is in bounds unless 1 byte patterns are present */
+    bool check_second = ks->bcSize > 1;
+
+    for ( ; T < Tend; T++ )
+    {
+        if ( KTRIE_BIT_SET(ks->fbset, T[0]) and
+            (!check_second or KTRIE_BIT_SET(ks->sbset, T[1])) )
+            break;
+    }
+    return T;
+}
+
+#ifdef KTRIE_VECTOR_SCAN
+__attribute__((target("ssse3")))
+static inline unsigned KTrieScanBlock128(__m128i lo, __m128i hi, __m128i v)
+{
+    const __m128i highbit = _mm_set1_epi8((char)0x80);
+    const __m128i bits = _mm_set1_epi64x((long long)0x8040201008040201ULL);
+
+    __m128i m1 = _mm_shuffle_epi8(lo, v);
+    __m128i m2 = _mm_shuffle_epi8(hi, _mm_xor_si128(v, highbit));
+    __m128i b = _mm_shuffle_epi8(bits, _mm_andnot_si128(highbit, _mm_srli_epi64(v, 4)));
+    __m128i r = _mm_and_si128(_mm_or_si128(m1, m2), b);
+
+    return ~_mm_movemask_epi8(_mm_cmpeq_epi8(r, _mm_setzero_si128())) & 0xffff;
+}
+
+__attribute__((target("ssse3")))
+static const uint8_t* KTrieScanSSSE3(
+    const KTRIE_STRUCT* ks, const uint8_t* T, const uint8_t* Tend)
+{
+    const __m128i flo = _mm_loadu_si128((const __m128i*)ks->fbmask);
+    const __m128i fhi = _mm_loadu_si128((const __m128i*)(ks->fbmask + 16));
+    const __m128i slo = _mm_loadu_si128((const __m128i*)ks->sbmask);
+    const __m128i shi = _mm_loadu_si128((const __m128i*)(ks->sbmask + 16));
+
+    for ( ; T + 16 < Tend; T += 16 )
+    {
+        unsigned m = KTrieScanBlock128(flo, fhi, _mm_loadu_si128((const __m128i*)T));
+
+        if ( m )
+            m &= KTrieScanBlock128(slo, shi, _mm_loadu_si128((const __m128i*)(T + 1)));
+
+        if ( m )
+            return T + __builtin_ctz(m);
+    }
+    return KTrieScanTail(ks, T, Tend);
+}
+
+__attribute__((target("avx2")))
+static inline unsigned KTrieScanBlock256(__m256i lo, __m256i hi, __m256i v)
+{
+    const __m256i highbit = _mm256_set1_epi8((char)0x80);
+    const __m256i bits = _mm256_set1_epi64x((long long)0x8040201008040201ULL);
+
+    __m256i m1 = _mm256_shuffle_epi8(lo, v);
+    __m256i m2 = _mm256_shuffle_epi8(hi, _mm256_xor_si256(v, highbit));
+    __m256i b = _mm256_shuffle_epi8(bits, _mm256_andnot_si256(highbit, _mm256_srli_epi64(v, 4)));
+    __m256i r = _mm256_and_si256(_mm256_or_si256(m1, m2), b);
+
+    return ~(unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(r, _mm256_setzero_si256()));
+}
+
+__attribute__((target("avx2")))
+static const uint8_t* KTrieScanAVX2(
+    const KTRIE_STRUCT* ks, const uint8_t* T, const uint8_t* Tend)
+{
+    const __m256i flo = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)ks->fbmask));
+    const __m256i fhi = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)(ks->fbmask + 16)));
+    const __m256i slo = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)ks->sbmask));
+    const __m256i shi = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)(ks->sbmask + 16)));
+
+    for ( ; T + 32 < Tend; T += 32 )
+    {
+        unsigned m = KTrieScanBlock256(flo, fhi, _mm256_loadu_si256((const __m256i*)T));
+
+        if ( m )
+            m &= KTrieScanBlock256(slo, shi, _mm256_loadu_si256((const __m256i*)(T + 1)));
+
+        if ( m )
+            return T + __builtin_ctz(m);
+    }
+    return KTrieScanTail(ks, T, Tend);
+}
+#endif
+
+static KTRIE_SCAN KTrieSelectScan()
+{
+#ifdef KTRIE_VECTOR_SCAN
+    __builtin_cpu_init();
+
+    if ( __builtin_cpu_supports("avx2") )
+        return KTrieScanAVX2;
+
+    if ( __builtin_cpu_supports("ssse3") )
+        return KTrieScanSSSE3;
+#endif
+    return nullptr;
+}
+
+static int KTrieBitCount(const uint8_t* set)
+{
+    int n = 0;
+
+    for ( int i = 0; i < 32; i++ )
+        n += __builtin_popcount(set[i]);
+
+    return n;
+}
+
+/*
+*  Build the 1st and 2nd byte sets.  Nocase patterns contribute both
+*  cases of each byte.  The scan is only used when the sets are selective
+*  enough to beat the bad character shifts.
+*/
+static void Build_Scan_Filter(KTRIE_STRUCT* kt)
+{
+    memset(kt->fbset, 0, sizeof(kt->fbset));
+    memset(kt->sbset, 0, sizeof(kt->sbset));
+    memset(kt->fbmask, 0, sizeof(kt->fbmask));
+    memset(kt->sbmask, 0, sizeof(kt->sbmask));
+
+    for ( KTRIEPATTERN* p = kt->patrn; p; p = p->next )
+    {
+        for ( int k = 0; k < 2 and k < p->n; k++ )
+        {
+            uint8_t* set = k ? kt->sbset : kt->fbset;
+            uint8_t* mask = k ? kt->sbmask : kt->fbmask;
+
+            if ( p->nocase )
+            {
+                Build_Scan_Set(set, mask, p->P[k]);
+                Build_Scan_Set(set, mask, (uint8_t)toupper(p->P[k]));
+            }
+            else
+                Build_Scan_Set(set, mask, p->Pcase[k]);
+        }
+
+        /* a 1 byte pattern matches regardless of what follows */
+        if ( p->n == 1 )
+        {
+            for ( int c = 0; c < KTRIE_ROOT_NODES; c++ )
+                Build_Scan_Set(kt->sbset, kt->sbmask, (uint8_t)c);
+        }
+    }
+
+    kt->scan = nullptr;
+
+    if ( KTrieBitCount(kt->fbset) * KTrieBitCount(kt->sbset) <= KTRIE_SCAN_MAX_PASS )
+        kt->scan = KTrieSelectScan();
+}
+
+/*
+*  Build the q-gram shift table - Wu-Manber with blocks of 2 case folded
+*  bytes hashed into a small table.  It is only built when some patterns
+*  are too short for the bad character shift.  The short patterns are set
+*  apart in a bitmap of their 1st bytes and the shifts are taken over the
+*  1st wmSize bytes of the rest.
+*/
+static void Build_WM_Shifts(KTRIE_STRUCT* kt)
+{
+    kt->wmSize = 0;
+    kt->wmShift = nullptr;
+    memset(kt->wmshort, 0, sizeof(kt->wmshort));
+
+    if ( kt->bcSize >= KTRIE_WM_SHORT )
+        return;
+
+    int m = KTRIE_WM_MAX_SIZE;
+    bool any = false;
+
+    for ( KTRIEPATTERN* p = kt->patrn; p; p = p->next )
+    {
+        if ( p->n < KTRIE_WM_SHORT )
+        {
+            uint8_t c = p->nocase ? p->P[0] : p->Pcase[0];
+            kt->wmshort[c >> 3] |= (uint8_t)(1 << (c & 7));
+
+            if ( p->nocase )
+            {
+                c = (uint8_t)toupper(c);
+                kt->wmshort[c >> 3] |= (uint8_t)(1 << (c & 7));
+            }
+        }
+        else
+        {
+            if ( p->n < m )
+                m = p->n;
+            any = true;
+        }
+    }
+
+    if ( !any or KTrieBitCount(kt->wmshort) > KTRIE_WM_MAX_SHORT )
+        return;
+
+    kt->wmSize = m;
+    kt->wmShift = (uint8_t*)KTRIE_MALLOC(&kt->memory, KTrieBuildArena(kt), KTRIE_WM_HASH);
+
+    memset(kt->wmShift, m - 1, KTRIE_WM_HASH);
+
+    for ( KTRIEPATTERN* p = kt->patrn; p; p = p->next )
+    {
+        if ( p->n < KTRIE_WM_SHORT )
+            continue;
+
+        for ( int k = 1; k < m; k++ )
+        {
+            unsigned i = KTRIE_WM_INDEX(p->P[k - 1], p->P[k]);
+            int shift = m - 1 - k;
+
+            if ( shift < kt->wmShift[i] )
+                kt->wmShift[i] = (uint8_t)shift;
+        }
+    }
+}
+
+/*
+*  Add the nodes and counts of a compile thread to the trie
+*/
+static void KTrieMergeBuild(KTRIE_STRUCT* ts, KTRIEBUILD* b)
+{
+    if ( b->nodemem )
+    {
+        KTRIECHUNK* c = b->nodemem;
+
+        while ( c->next )
+            c = c->next;
+
+        c->next = ts->nodemem;
+        ts->nodemem = b->nodemem;
+    }
+
+    ts->memory += b->memory;
+    ts->nchars += b->nchars;
+    ts->duplicates += b->duplicates;
+    ts->end_states += b->end_states;
+}
+
+/*
+*  Insert the patterns with multiple threads.  Each root slot is an
+*  independent sub-trie so patterns are split into buckets by trie and
+*  1st byte and the buckets are handed out to the threads.  Patterns
+*  are inserted in list order within a bucket so the result is the same
+*  as a serial build.
+*/
+static int KTrieInsertParallel(KTRIE_STRUCT* ts, unsigned nthreads)
+{
+    std::vector<std::vector<KTRIEPATTERN*>> buckets(2 * KTRIE_ROOT_NODES);
+
+    for ( KTRIEPATTERN* p = ts->patrn; p; p = p->next )
+    {
+        unsigned i = p->nocase ? p->P[0] : KTRIE_ROOT_NODES + p->Pcase[0];
+        buckets[i].push_back(p);
+    }
+
+    std::vector<KTRIEBUILD> builds(nthreads);
+    std::vector<std::thread> threads;
+    std::atomic<unsigned> next { 0 };
+    std::atomic<int> rval { 0 };
+
+    for ( unsigned t = 0; t < nthreads; t++ )
+    {
+        threads.emplace_back([&, t]()
+        {
+            unsigned i;
+
+            while ( (i = next++) < buckets.size() )
+            {
+                for ( KTRIEPATTERN* p : buckets[i] )
+                {
+                    if ( KTrieInsert(ts, &builds[t], p) )
+                        rval = -1;
+                }
+            }
+        });
+    }
+
+    for ( auto& t : threads )
+        t.join();
+
+    for ( auto& b : builds )
+        KTrieMergeBuild(ts, &b);
+
+    return rval;
+}
+
+static int KTrieInsertAll(KTRIE_STRUCT* ts)
+{
+    unsigned nthreads = ts->config.compile_threads;
+
+    if ( !nthreads )
+        nthreads = std::thread::hardware_concurrency();
+
+    if ( nthreads > 1 and ts->npats >= KTRIE_MT_MIN_PATTERNS )
+        return KTrieInsertParallel(ts, nthreads);
+
+    KTRIEBUILD b;
+    int rval = 0;
+
+    for ( KTRIEPATTERN* p=ts->patrn; p; p=p->next )
+    {
+        if ( KTrieInsert(ts, &b, p) )
+        {
+            rval = -1;
+            break;
+        }
+    }
+
+    KTrieMergeBuild(ts, &b);
+    return rval;
+}
+
+/*
+*  Compiled trie images - the flattened trie and shift table are written
+*  to cache_dir so later runs with the same patterns can map the file
+*  instead of compiling.  Images hold only offsets and indices so they
+*  may be mapped anywhere and the pages are shared by every process that
+*  maps them.  Match lists are stored as pattern ordinals in patrn order;
+*  the pattern list itself is still built by KTrieAddPattern.
 *
-*   returns:
-*   # pattern matches
+*  The same images are shared in memory by tries with the same patterns,
+*  whether from different groups or from the previous configuration on
+*  reload; see KTrieShare below.
+*/
+#define KTRIE_IMAGE_MAGIC   "KTRIEIMG"
+#define KTRIE_IMAGE_VERSION 2
+
+struct KTRIEIMAGE
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t header_size;   /* these 2 catch layout changes*/
+    uint32_t node_size;
+    uint32_t npats;
+
+    uint64_t hash;          /* of the patterns*/
+    uint64_t size;          /* of the whole image*/
+
+    uint32_t fnodes;
+    uint32_t fmatches;
+
+    int32_t nchars;
+    int32_t duplicates;
+    int32_t end_states;
+    int32_t bcSize;
+    int32_t maxSize;
+    uint32_t fdenses;
+
+    uint64_t fnode_off;     /* KTRIEFNODE[fnodes]*/
+    uint64_t fedge_off;     /* uint8_t[fnodes]*/
+    uint64_t mstart_off;    /* uint32_t[fmatches + 1], 1st mlist entry of each list*/
+    uint64_t mlist_off;     /* uint32_t[npats], pattern ordinals*/
+    uint64_t fdense_off;    /* uint8_t[fdenses * 256]*/
+
+    uint32_t froot[KTRIE_ROOT_NODES];
+    uint32_t fcroot[KTRIE_ROOT_NODES];
+    uint16_t bcShift[KTRIE_ROOT_NODES];
+};
+
+/*
+*  Hash of everything that determines the compiled trie
+*/
+static uint64_t KTriePatternHash(const KTRIE_STRUCT* ts)
+{
+    uint64_t h = KTRIE_HASH_INIT;
+    uint32_t v[3] = { KTRIE_IMAGE_VERSION, sizeof(KTRIEIMAGE), sizeof(KTRIEFNODE) };
+    uint64_t layout[2] = { ts->config.dense_levels, ts->config.memory_budget };
+
+    h = KTrieHash(h, v, sizeof(v));
+    h = KTrieHash(h, layout, sizeof(layout));
+
+    for ( const KTRIEPATTERN* p = ts->patrn; p; p = p->next )
+    {
+        int32_t a[3] = { p->n, p->nocase, p->negative };
+
+        h = KTrieHash(h, a, sizeof(a));
+        h = KTrieHash(h, p->Pcase, p->n);
+    }
+
+    return h;
+}
+
+/*
+*  The patterns in full, in the order of the hash - shared images are
+*  only used by tries with the same key so a hash collision can't swap
+*  in the trie of other patterns
+*/
+static std::string KTriePatternKey(const KTRIE_STRUCT* ts)
+{
+    std::string key;
+    uint64_t layout[2] = { ts->config.dense_levels, ts->config.memory_budget };
+
+    key.append((const char*)layout, sizeof(layout));
+
+    for ( const KTRIEPATTERN* p = ts->patrn; p; p = p->next )
+    {
+        int32_t a[3] = { p->n, p->nocase, p->negative };
+
+        key.append((const char*)a, sizeof(a));
+        key.append((const char*)p->Pcase, p->n);
+    }
+
+    return key;
+}
+
+static inline uint64_t KTrieImageAlign(uint64_t off)
+{
+    return (off + 7) & ~(uint64_t)7;
+}
+
+static inline bool KTrieImageFits(const KTRIEIMAGE* img, uint64_t off, uint64_t len)
+{
+    return off <= img->size and len <= img->size - off;
+}
+
+/*
+*  Images may be stale or damaged so everything the search will follow is
+*  checked before use.  This is linear in the trie size, still much less
+*  than compiling.
+*/
+static bool KTrieCheckImage(const KTRIE_STRUCT* ts, const KTRIEIMAGE* img, size_t size, uint64_t hash)
+{
+    if ( memcmp(img->magic, KTRIE_IMAGE_MAGIC, sizeof(img->magic)) or
+        img->version != KTRIE_IMAGE_VERSION or
+        img->header_size != sizeof(KTRIEIMAGE) or img->node_size != sizeof(KTRIEFNODE) or
+        img->hash != hash or img->size != size or img->npats != (uint32_t)ts->npats or
+        !img->fnodes or img->fmatches > img->npats )
+        return false;
+
+    if ( (img->fnode_off % alignof(KTRIEFNODE)) or (img->mstart_off % 4) or (img->mlist_off % 4) or
+        !KTrieImageFits(img, img->fnode_off, (uint64_t)img->fnodes * sizeof(KTRIEFNODE)) or
+        !KTrieImageFits(img, img->fedge_off, img->fnodes) or
+        !KTrieImageFits(img, img->mstart_off, ((uint64_t)img->fmatches + 1) * 4) or
+        !KTrieImageFits(img, img->mlist_off, (uint64_t)img->npats * 4) or
+        !KTrieImageFits(img, img->fdense_off, (uint64_t)img->fdenses * KTRIE_ROOT_NODES) )
+        return false;
+
+    const uint8_t* base = (const uint8_t*)img;
+    const KTRIEFNODE* fnode = (const KTRIEFNODE*)(base + img->fnode_off);
+    const uint8_t* fdense = base + img->fdense_off;
+
+    for ( uint32_t i = 1; i < img->fnodes; i++ )
+    {
+        const KTRIEFNODE* f = fnode + i;
+        unsigned n = f->nkids & ~KTRIE_DENSE;
+
+        if ( f->match > img->fmatches or n > KTRIE_ROOT_NODES )
+            return false;
+
+        if ( n and (!f->kids or f->kids >= img->fnodes or n > img->fnodes - f->kids) )
+            return false;
+
+        if ( f->nkids & KTRIE_DENSE )
+        {
+            uint32_t d;
+            memcpy(&d, f->edge + 2, sizeof(d));
+
+            if ( n <= KTRIE_INLINE_KIDS or d >= img->fdenses )
+                return false;
+
+            for ( unsigned c = 0; c < KTRIE_ROOT_NODES; c++ )
+            {
+                if ( fdense[d * KTRIE_ROOT_NODES + c] > n )
+                    return false;
+            }
+        }
+    }
+
+    for ( int i = 0; i < KTRIE_ROOT_NODES; i++ )
+    {
+        if ( img->froot[i] >= img->fnodes or img->fcroot[i] >= img->fnodes )
+            return false;
+    }
+
+    /* every pattern must be on exactly one match list */
+    const uint32_t* mstart = (const uint32_t*)(base + img->mstart_off);
+    const uint32_t* mlist = (const uint32_t*)(base + img->mlist_off);
+    std::vector<bool> seen(img->npats);
+
+    if ( mstart[0] or mstart[img->fmatches] != img->npats )
+        return false;
+
+    for ( uint32_t m = 0; m < img->fmatches; m++ )
+    {
+        if ( mstart[m] >= mstart[m + 1] )
+            return false;
+    }
+
+    for ( uint32_t k = 0; k < img->npats; k++ )
+    {
+        if ( mlist[k] >= img->npats or seen[mlist[k]] )
+            return false;
+
+        seen[mlist[k]] = true;
+    }
+
+    return true;
+}
+
+/*
+*  Point the trie at the flattened trie and shift table of an image
+*/
+static void KTrieUseImage(KTRIE_STRUCT* ts, const KTRIEIMAGE* img)
+{
+    const uint8_t* base = (const uint8_t*)img;
+
+    /* the search never writes the flattened trie */
+    ts->fnode = (KTRIEFNODE*)(base + img->fnode_off);
+    ts->fedge = (uint8_t*)(base + img->fedge_off);
+    ts->fdense = img->fdenses ? (uint8_t*)(base + img->fdense_off) : nullptr;
+    ts->fnodes = img->fnodes;
+    ts->fmatches = img->fmatches;
+    ts->fdenses = img->fdenses;
+
+    memcpy(ts->froot, img->froot, sizeof(ts->froot));
+    memcpy(ts->fcroot, img->fcroot, sizeof(ts->fcroot));
+    memcpy(ts->bcShift, img->bcShift, sizeof(ts->bcShift));
+
+    ts->nchars = img->nchars;
+    ts->duplicates = img->duplicates;
+    ts->end_states = img->end_states;
+    ts->bcSize = img->bcSize;
+    ts->maxSize = img->maxSize;
+}
+
+/*
+*  Build the match lists of the trie's own patterns from an image
+*/
+static void KTrieUseImageMatches(KTRIE_STRUCT* ts, const KTRIEIMAGE* img)
+{
+    const uint8_t* base = (const uint8_t*)img;
+    const uint32_t* mstart = (const uint32_t*)(base + img->mstart_off);
+    const uint32_t* mlist = (const uint32_t*)(base + img->mlist_off);
+
+    std::vector<KTRIEPATTERN*> pats;
+    pats.reserve(ts->npats);
+
+    for ( KTRIEPATTERN* p = ts->patrn; p; p = p->next )
+        pats.push_back(p);
+
+    /* rebuild the duplicate chains in their original order */
+    ts->fmatch = (KTRIEPATTERN**)KTRIE_MALLOC(
+        &ts->memory, &ts->mem, (img->fmatches + 1) * sizeof(KTRIEPATTERN*));
+
+    for ( uint32_t m = 0; m < img->fmatches; m++ )
+    {
+        KTRIEPATTERN* head = nullptr;
+
+        for ( uint32_t k = mstart[m + 1]; k > mstart[m]; k-- )
+        {
+            KTRIEPATTERN* p = pats[mlist[k - 1]];
+            p->mnext = head;
+            head = p;
+        }
+        ts->fmatch[m] = head;
+    }
+}
+
+/*
+*  Map the image, if there is a good one, in place of compiling
+*/
+static KTRIEIMAGE* KTrieLoadImage(const KTRIE_STRUCT* ts, const char* path, uint64_t hash)
+{
+    int fd = open(path, O_RDONLY);
+
+    if ( fd < 0 )
+        return nullptr;
+
+    struct stat st;
+
+    if ( fstat(fd, &st) or (size_t)st.st_size < sizeof(KTRIEIMAGE) )
+    {
+        close(fd);
+        return nullptr;
+    }
+
+    size_t size = st.st_size;
+    void* map = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+
+    if ( map == MAP_FAILED )
+        return nullptr;
+
+    if ( !KTrieCheckImage(ts, (const KTRIEIMAGE*)map, size, hash) )
+    {
+        munmap(map, size);
+        return nullptr;
+    }
+
+    return (KTRIEIMAGE*)map;
+}
+
+/*
+*  Copy a compiled trie into a new image
+*/
+static KTRIEIMAGE* KTrieMakeImage(const KTRIE_STRUCT* ts, uint64_t hash)
+{
+    KTRIEIMAGE img;
+    memset(&img, 0, sizeof(img));
+
+    memcpy(img.magic, KTRIE_IMAGE_MAGIC, sizeof(img.magic));
+    img.version = KTRIE_IMAGE_VERSION;
+    img.header_size = sizeof(KTRIEIMAGE);
+    img.node_size = sizeof(KTRIEFNODE);
+    img.npats = ts->npats;
+    img.hash = hash;
+
+    img.fnodes = ts->fnodes;
+    img.fmatches = ts->fmatches;
+
+    img.nchars = ts->nchars;
+    img.duplicates = ts->duplicates;
+    img.end_states = ts->end_states;
+    img.bcSize = ts->bcSize;
+    img.maxSize = ts->maxSize;
+    img.fdenses = ts->fdenses;
+
+    memcpy(img.froot, ts->froot, sizeof(img.froot));
+    memcpy(img.fcroot, ts->fcroot, sizeof(img.fcroot));
+    memcpy(img.bcShift, ts->bcShift, sizeof(img.bcShift));
+
+    img.fnode_off = KTrieImageAlign(sizeof(img));
+    img.fedge_off = img.fnode_off + (uint64_t)ts->fnodes * sizeof(KTRIEFNODE);
+    img.mstart_off = KTrieImageAlign(img.fedge_off + ts->fnodes);
+    img.mlist_off = img.mstart_off + ((uint64_t)ts->fmatches + 1) * 4;
+    img.fdense_off = img.mlist_off + (uint64_t)ts->npats * 4;
+    img.size = img.fdense_off + (uint64_t)ts->fdenses * KTRIE_ROOT_NODES;
+
+    uint8_t* base = (uint8_t*)snort_calloc(img.size);
+
+    memcpy(base, &img, sizeof(img));
+    memcpy(base + img.fnode_off, ts->fnode, ts->fnodes * sizeof(KTRIEFNODE));
+    memcpy(base + img.fedge_off, ts->fedge, ts->fnodes);
+
+    if ( ts->fdenses )
+        memcpy(base + img.fdense_off, ts->fdense, ts->fdenses * KTRIE_ROOT_NODES);
+
+    std::unordered_map<const KTRIEPATTERN*, uint32_t> ordinal;
+    uint32_t n = 0;
+
+    for ( const KTRIEPATTERN* p = ts->patrn; p; p = p->next )
+        ordinal[p] = n++;
+
+    uint32_t* mstart = (uint32_t*)(base + img.mstart_off);
+    uint32_t* mlist = (uint32_t*)(base + img.mlist_off);
+    n = 0;
+
+    for ( uint32_t m = 0; m < ts->fmatches; m++ )
+    {
+        mstart[m] = n;
+
+        for ( const KTRIEPATTERN* p = ts->fmatch[m]; p; p = p->mnext )
+            mlist[n++] = ordinal[p];
+    }
+    mstart[ts->fmatches] = n;
+
+    return (KTRIEIMAGE*)base;
+}
+
+/*
+*  Write an image.  It is written under a unique temporary name and
+*  renamed so other processes never map a partial image and concurrent
+*  writers can't collide.
+*/
+static int KTrieSaveImage(const KTRIEIMAGE* img, const char* path)
+{
+    char tmp[4096];
+
+    if ( snprintf(tmp, sizeof(tmp), "%s.XXXXXX", path) >= (int)sizeof(tmp) )
+        return -1;
+
+    int fd = mkstemp(tmp);
+
+    if ( fd < 0 )
+        return -1;
+
+    /* mkstemp makes the file private but other processes map images */
+    FILE* fh = fchmod(fd, 0644) ? nullptr : fdopen(fd, "wb");
+
+    if ( !fh )
+    {
+        close(fd);
+        unlink(tmp);
+        return -1;
+    }
+
+    bool ok = fwrite(img, 1, img->size, fh) == img->size;
+
+    if ( fclose(fh) )
+        ok = false;
+
+    if ( !ok or rename(tmp, path) )
+    {
+        unlink(tmp);
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+*  Shared images - tries with share set look up their pattern hash here
+*  before compiling and add their image after, so identical groups keep
+*  one flattened trie.  The hash only finds the candidate; the pattern
+*  key must match too, else the trie keeps a private flattened trie.
+*  Each trie still has its own patterns and match lists since those
+*  carry the group's rule trees.  Images are released
+*  with the last trie using them; on reload the previous configuration
+*  holds them until the new one has been compiled.
+*/
+struct KTRIESHARED
+{
+    KTRIEIMAGE* img;
+    std::string key;        /* see KTriePatternKey*/
+    bool mapped;            /* from cache_dir, else allocated*/
+    unsigned refs;
+};
+
+static std::mutex kshared_mutex;
+static std::unordered_map<uint64_t, KTRIESHARED> kshared;
+
+static KTRIEIMAGE* KTrieFindShared(uint64_t hash, const std::string& key)
+{
+    std::lock_guard<std::mutex> lock(kshared_mutex);
+    auto it = kshared.find(hash);
+
+    if ( it == kshared.end() or it->second.key != key )
+        return nullptr;
+
+    it->second.refs++;
+    stot++;
+
+    return it->second.img;
+}
+
+/*
+*  returns the image to use, which is another if one was added meanwhile,
+*  or null if the hash is taken by other patterns; img is then not shared
+*  and still belongs to the caller
+*/
+static KTRIEIMAGE* KTrieShare(uint64_t hash, std::string& key, KTRIEIMAGE* img, bool mapped)
+{
+    std::lock_guard<std::mutex> lock(kshared_mutex);
+    auto it = kshared.find(hash);
+
+    if ( it != kshared.end() and it->second.key != key )
+        return nullptr;
+
+    if ( it != kshared.end() )
+    {
+        if ( mapped )
+            munmap(img, img->size);
+        else
+            snort_free(img);
+
+        it->second.refs++;
+        stot++;
+
+        return it->second.img;
+    }
+
+    kshared[hash] = { img, std::move(key), mapped, 1 };
+
+    if ( !mapped )
+        mtot += img->size;
+
+    return img;
+}
+
+static void KTrieUnshare(uint64_t hash)
+{
+    std::lock_guard<std::mutex> lock(kshared_mutex);
+    auto it = kshared.find(hash);
+
+    assert(it != kshared.end());
+
+    if ( --it->second.refs )
+    {
+        stot--;
+        return;
+    }
+
+    KTRIEIMAGE* img = it->second.img;
+
+    if ( it->second.mapped )
+        munmap(img, img->size);
+    else
+    {
+        mtot -= img->size;
+        snort_free(img);
+    }
+
+    kshared.erase(it);
+}
+
+static int KTrieImagePath(char* path, size_t size, const char* dir, uint64_t hash)
+{
+    int n = snprintf(path, size, "%s/lowmem-%016" PRIx64 ".trie", dir, hash);
+    return (n < 0 or (size_t)n >= size) ? -1 : 0;
+}
+
+static inline int _KTrieCompile(KTRIE_STRUCT* ts)
+{
+    /*
+    static int  tmem=0;  // unused
+    */
+
+    /*
+    *    Build the Keyword TRIE
+    */
+    if ( KTrieInsertAll(ts) )
+        return -1;
+
+    /*
+    *    Build A Setwise Bad Character Shift Table
+    */
+    Build_Bad_Character_Shifts(ts);
+
+    /*
+    *    Build the vector scan filter
+    */
+    Build_Scan_Filter(ts);
+
+    /*
+    *    Build the q-gram shifts for groups with short patterns
+    */
+    Build_WM_Shifts(ts);
+
+    /*
+    tmem += ts->memory;
+    printf(" Compile stats: %d patterns, %d chars, %d duplicate patterns, %d bytes, %d total-bytes\n",ts->npats,ts->nchars,ts->duplicates,ts->memory,tmem);
+    */
+
+    return 0;
+}
+
+static int KTrieBuild(snort::SnortConfig* sc, KTRIE_STRUCT* ts)
+{
+    int rval;
+    char path[4096];
+    uint64_t hash = 0;
+    std::string key;
+    bool cache = false;
+    bool incremental = ts->config.incremental;
+    bool share = ts->config.share and ts->npats and !incremental;
+
+    /* no more strings to intern */
+    if ( !incremental )
+        KTrieInternFree(ts);
+
+    /* incremental tries are changed in place so they have no image */
+    if ( (ts->config.cache_dir or share) and ts->npats and !incremental )
+        hash = KTriePatternHash(ts);
+
+    if ( ts->config.cache_dir and ts->npats and !incremental )
+        cache = !KTrieImagePath(path, sizeof(path), ts->config.cache_dir, hash);
+
+    if ( share )
+        key = KTriePatternKey(ts);
+
+    KTRIEIMAGE* img = share ? KTrieFindShared(hash, key) : nullptr;
+    bool shared = img != nullptr;
+
+    if ( !img and cache and (img = KTrieLoadImage(ts, path, hash)) )
+    {
+        ts->image_loaded = true;
+        itot++;
+
+        if ( share )
+        {
+            /* a mapped image that can't be shared is kept private */
+            if ( KTRIEIMAGE* simg = KTrieShare(hash, key, img, true) )
+            {
+                img = simg;
+                shared = true;
+            }
+        }
+    }
+
+    if ( img )
+    {
+        KTrieUseImage(ts, img);
+        KTrieUseImageMatches(ts, img);
+
+        ts->image = img;
+        ts->image_size = img->size;
+        ts->image_hash = hash;
+        ts->image_shared = shared;
+        ntot += ts->fnodes - 1;
+
+        Build_Scan_Filter(ts);
+        Build_WM_Shifts(ts);
+
+        if ( ts->agent )
+        {
+            for ( uint32_t m = 0; m < ts->fmatches; m++ )
+                KTrieBuildMatchState(sc, ts->fmatch[m], ts);
+        }
+
+        KTrieUpdateMax(ts);
+        return 0;
+    }
+
+    if ((rval = _KTrieCompile(ts)))
+        return rval;
+
+    if ( ts->agent )
+        KTrieBuildMatchStateTrees(sc, ts);
+
+    if ((rval = KTrieFlatten(ts)))
+        return rval;
+
+    KTrieBuildDense(ts);
+
+    if ( cache or share )
+    {
+        img = KTrieMakeImage(ts, hash);
+
+        /* if this fails the next run just compiles again */
+        if ( cache )
+            KTrieSaveImage(img, path);
+
+        KTRIEIMAGE* simg = share ? KTrieShare(hash, key, img, false) : nullptr;
+
+        if ( simg )
+        {
+            /* switch to the shared copy and drop this one */
+            img = simg;
+            KTrieUseImage(ts, img);
+            KTRIE_FREE(&ts->memory, &ts->flatmem);
+
+            ts->image = img;
+            ts->image_size = img->size;
+            ts->image_hash = hash;
+            ts->image_shared = true;
+        }
+        else
+            snort_free(img);
+    }
+
+    KTrieUpdateMax(ts);
+    return 0;
+}
+
+/*
+*  Find the node of a pattern in the linked trie.  If path is given the
+*  link to each node on the way is added, in order, so nodes can be
+*  unlinked.
+*/
+static KTRIENODE* KTrieFindNode(
+    KTRIE_STRUCT* ts, const KTRIEPATTERN* p, std::vector<KTRIENODE**>* path = nullptr)
+{
+    const uint8_t* P = p->nocase ? p->P : p->Pcase;
+    KTRIENODE** link = (p->nocase ? ts->root : ts->croot) + P[0];
+
+    for ( int k = 0; k < p->n; k++ )
+    {
+        while ( *link and (*link)->edge != P[k] )
+            link = &(*link)->sibling;
+
+        if ( !*link )
+            return nullptr;
+
+        if ( path )
+            path->push_back(link);
+
+        if ( k + 1 < p->n )
+            link = &(*link)->child;
+    }
+
+    return *link;
+}
+
+/*
+*  Take a compiled pattern off its match list and prune the nodes that
+*  no longer lead to a pattern
+*/
+static void KTrieUnlink(KTRIE_STRUCT* ts, KTRIEPATTERN* px)
+{
+    std::vector<KTRIENODE**> path;
+    KTRIENODE* t = KTrieFindNode(ts, px, &path);
+
+    assert(t);
+
+    KTRIEPATTERN** pp = &t->pkeyword;
+
+    while ( *pp != px )
+        pp = &(*pp)->mnext;
+
+    *pp = px->mnext;
+    px->mnext = nullptr;
+
+    if ( t->pkeyword )
+    {
+        /* the rest of the list needs a new match state */
+        t->pkeyword->pending |= KTRIE_PENDING_STATE;
+        ts->duplicates--;
+        return;
+    }
+
+    ts->end_states--;
+
+    for ( int k = (int)path.size() - 1; k >= 0; k-- )
+    {
+        KTRIENODE* x = *path[k];
+
+        if ( x->pkeyword or x->child )
+            break;
+
+        *path[k] = x->sibling;
+
+        x->sibling = ts->nodefree;
+        ts->nodefree = x;
+
+        /* root nodes aren't counted in nchars */
+        if ( k )
+            ts->nchars--;
+    }
+}
+
+static void KTrieFreeMatchState(KTRIE_STRUCT* ts, KTRIEPATTERN* p)
+{
+    if ( p->rule_option_tree )
+        ts->agent->tree_free(&p->rule_option_tree);
+
+    if ( p->neg_list )
+        ts->agent->list_free(&p->neg_list);
+}
+
+int KTrieRemovePattern(
+    KTRIE_STRUCT* ts, const uint8_t* P, unsigned n,
+    bool nocase, bool negative, void* user)
+{
+    if ( !ts->config.incremental or n < 1 )
+        return -1;
+
+    KTRIEPATTERN** pp = &ts->patrn;
+
+    while ( *pp )
+    {
+        KTRIEPATTERN* p = *pp;
+
+        if ( p->user == user and (unsigned)p->n == n and p->nocase == nocase and
+            p->negative == negative and !memcmp(p->Pcase, P, n) )
+            break;
+
+        pp = &p->next;
+    }
+
+    KTRIEPATTERN* px = *pp;
+
+    if ( !px )
+        return -1;
+
+    *pp = px->next;
+
+    /* not inserted yet if added since the last update */
+    if ( ts->fnode and !(px->pending & KTRIE_PENDING_INSERT) )
+        KTrieUnlink(ts, px);
+
+    if ( ts->agent )
+    {
+        if ( px->user )
+            ts->agent->user_free(px->user);
+
+        KTrieFreeMatchState(ts, px);
+    }
+
+    if ( !px->nocase )
+        ts->ncase--;
+
+    ts->npats--;
+    ts->removed++;
+    ptot--;
+
+    px->next = ts->patfree;
+    ts->patfree = px;
+
+    return 0;
+}
+
+/*
+*  Lower the bad character shifts for new patterns, which is all that
+*  changes as long as bcSize doesn't
+*/
+static void KTrieAddShifts(KTRIE_STRUCT* kt, const std::vector<KTRIEPATTERN*>& added)
+{
+    for ( const KTRIEPATTERN* p : added )
+    {
+        if ( p->n > kt->maxSize )
+            kt->maxSize = p->n;
+
+        for ( int k = 0; k < kt->bcSize; k++ )
+        {
+            int shift = kt->bcSize - 1 - k;
+            int cindex = p->P[ k ];
+
+            if ( shift < kt->bcShift[ cindex ] )
+                kt->bcShift[ cindex ] = (unsigned short)shift;
+        }
+    }
+
+    /* fold case again */
+    for ( int i = 0; i < KTRIE_ROOT_NODES; i++ )
+        kt->bcShift[i] = kt->bcShift[ xlatcase[i] ];
+}
+
+/*
+*  Apply the patterns added and removed since compiling or the last
+*  update.  Only new patterns are inserted and only the match lists they
+*  or removed ones were on get new match states.  The shift table is
+*  updated in place unless a removal or a shorter pattern changed its
+*  size.  The flattened trie and the tables derived from it are rebuilt
+*  from the linked trie, which is linear in the number of nodes.
+*/
+int KTrieUpdate(snort::SnortConfig* sc, KTRIE_STRUCT* ts)
+{
+    if ( !ts->config.incremental or !ts->fnode )
+        return -1;
+
+    KTRIEBUILD b;
+    std::vector<KTRIEPATTERN*> added;
+    int rval = 0;
+    bool shifts = !ts->removed;
+
+    b.nodefree = ts->nodefree;
+
+    for ( KTRIEPATTERN* p = ts->patrn; p; p = p->next )
+    {
+        if ( !(p->pending & KTRIE_PENDING_INSERT) )
+            continue;
+
+        if ( KTrieInsert(ts, &b, p) )
+            rval = -1;
+
+        /* it's at the front of its list now */
+        p->pending = KTRIE_PENDING_STATE;
+        added.push_back(p);
+
+        if ( p->n < ts->bcSize )
+            shifts = false;
+    }
+
+    ts->nodefree = b.nodefree;
+    KTrieMergeBuild(ts, &b);
+
+    if ( rval )
+        return rval;
+
+    /* new match states for the changed lists */
+    for ( KTRIEPATTERN* p = ts->patrn; p; p = p->next )
+    {
+        if ( !(p->pending & KTRIE_PENDING_STATE) )
+            continue;
+
+        KTRIENODE* t = KTrieFindNode(ts, p);
+
+        for ( KTRIEPATTERN* q = t->pkeyword; q; q = q->mnext )
+        {
+            if ( ts->agent )
+                KTrieFreeMatchState(ts, q);
+
+            q->pending = 0;
+        }
+
+        if ( ts->agent )
+            KTrieBuildMatchState(sc, t->pkeyword, ts);
+    }
+
+    if ( shifts )
+        KTrieAddShifts(ts, added);
+    else
+        Build_Bad_Character_Shifts(ts);
+
+    ts->removed = 0;
+
+    /* reflatten */
+    ntot -= ts->fnodes - 1;
+    KTRIE_FREE(&ts->memory, &ts->flatmem);
+
+    memset(ts->froot, 0, sizeof(ts->froot));
+    memset(ts->fcroot, 0, sizeof(ts->fcroot));
+
+    if ( (rval = KTrieFlatten(ts)) )
+        return rval;
+
+    KTrieBuildDense(ts);
+    Build_Scan_Filter(ts);
+    Build_WM_Shifts(ts);
+    KTrieUpdateMax(ts);
+
+    return 0;
+}
+
+int KTrieCompile(snort::SnortConfig* sc, KTRIE_STRUCT* ts)
+{
+    KTrieClock::time_point start = KTrieClock::now();
+    int rval = KTrieBuild(sc, ts);
+    uint64_t usecs = KTrieUsecs(start);
+
+    ctot += usecs;
+    KTrieAtomicMax(cmax, usecs);
+
+    return rval;
+}
+
+void sfksearch_print_qinfo()
+{
+}
+
+/*
+*  Find the child of a flattened node for the given edge
+*/
+static inline uint32_t KTrieFindKid(
+    const KTRIE_STRUCT* kt, const KTRIEFNODE* f, uint8_t c)
+{
+    unsigned n = f->nkids;
+
+    if ( n <= KTRIE_INLINE_KIDS )
+    {
+        for ( unsigned k = 0; k < n and f->edge[k] <= c; k++ )
+        {
+            if ( f->edge[k] == c )
+                return f->kids + k;
+        }
+        return 0;
+    }
+
+    if ( n & KTRIE_DENSE )
+    {
+        uint32_t d;
+        memcpy(&d, f->edge + 2, sizeof(d));
+
+        unsigned k = kt->fdense[d * KTRIE_ROOT_NODES + c];
+        return k ? f->kids + k - 1 : 0;
+    }
+
+    /* all edges are present and sorted */
+    if ( n == KTRIE_ROOT_NODES )
+        return f->kids + c;
+
+    const uint8_t* e = kt->fedge + f->kids;
+    unsigned lo = 0;
+
+    while ( n > 0 )
+    {
+        unsigned half = n / 2;
+
+        if ( e[lo + half] < c )
+        {
+            lo += half + 1;
+            n -= half + 1;
+        }
+        else
+            n = half;
+    }
+
+    /* lo is past the last kid if all edges are less than c */
+    return ( lo < f->nkids and e[lo] == c ) ? f->kids + lo : 0;
+}
+
+/*
+*  Walk statistics - searches of tries with walk_stats set count into a
+*  KTRIE_WALKSTATS on the stack which is added to the totals at the end.
+*  The search paths take it as a pointer that is null otherwise so the
+*  uninstrumented paths inline without the counting.
+*/
+static void KTrieAddWalkStats(const KTRIE_WALKSTATS* ws)
+{
+    wtot.bytes += ws->bytes;
+    wtot.attempts += ws->attempts;
+    wtot.steps += ws->steps;
+    wtot.probes += ws->probes;
+    wtot.shifts += ws->shifts;
+    wtot.shift_bytes += ws->shift_bytes;
+    KTrieAtomicMax(wtot.max_depth, ws->max_depth);
+
+    wtot.match_continue += ws->match_continue;
+    wtot.match_stop += ws->match_stop;
+    wtot.match_negative += ws->match_negative;
+}
+
+/* edges KTrieFindKid compares - the flattened equivalent of sibling hops */
+static unsigned KTrieKidProbes(const KTRIEFNODE* f, uint8_t c)
+{
+    unsigned n = f->nkids;
+
+    if ( n <= KTRIE_INLINE_KIDS )
+    {
+        unsigned k = 0;
+
+        while ( k < n and f->edge[k] < c )
+            k++;
+
+        return k < n ? k + 1 : n;
+    }
+
+    if ( (n & KTRIE_DENSE) or n == KTRIE_ROOT_NODES )
+        return 1;
+
+    unsigned probes = 0;
+
+    for ( ; n; n /= 2 )
+        probes++;
+
+    return probes;
+}
+
+static inline void KTrieCountMatch(KTRIE_WALKSTATS* ws, int rval)
+{
+    if ( !rval )
+        ws->match_continue++;
+    else if ( rval > 0 )
+        ws->match_stop++;
+    else
+        ws->match_negative++;
+}
+
+/*
+*  Walk the flattened trie from node i along T reporting each keyword
+*  found.  index is the offset of T in the search buffer.  Text is case
+*  folded on the fly when walking the nocase trie.
 */
-static inline int KTriePrefixMatch(
-    KTRIE_STRUCT* kt, const uint8_t* T, const uint8_t*, const uint8_t* bT, int n,
-    MpseMatch match, void* context)
+static inline int KTrieWalk(
+    KTRIE_STRUCT* kt, uint32_t i, const uint8_t* T, int index, int n, bool nocase,
+    MpseMatch match, void* context, KTRIE_WALKSTATS* ws)
 {
-    KTRIENODE* root   = kt->root[ *T ];
     int nfound = 0;
-    KTRIEPATTERN* pk;
-    int index;
+    uint64_t depth = 0;
 
-    /* Check if any keywords start with this character */
-    if ( !root )
-        return 0;
-
-    while ( n )
+    while ( true )
     {
-        if ( root->edge == *T )
-        {
-            T++;
-            n--;
+        const KTRIEFNODE* f = kt->fnode + i;
 
-            pk = root->pkeyword;
-            if (pk)
-            {
-                index = (int)(T - bT);
-                nfound++;
-                if (match (pk->user, pk->rule_option_tree, index, context, pk->neg_list) > 0)
-                {
-                    return nfound;
-                }
-            }
+        T++;
+        n--;
+        index++;
+        depth++;
 
-            if ( n && root->child )
-            {
-                root = root->child;
-            }
-            else     /* cannot continue -- match is over */
-            {
-                break;
-            }
-        }
-        else
+        if ( f->match )
         {
-            if ( root->sibling )
-            {
-                root = root->sibling;
-            }
-            else     /* cannot continue */
-            {
+            KTRIEPATTERN* pk = kt->fmatch[f->match - 1];
+            nfound++;
+
+            int rval = match (pk->user, pk->rule_option_tree, index, context, pk->neg_list);
+
+            if ( ws )
+                KTrieCountMatch(ws, rval);
+
+            if ( rval > 0 )
                 break;
-            }
         }
+
+        /* cannot continue -- match is over */
+        if ( !n or !f->nkids )
+            break;
+
+        uint8_t c = nocase ? xlatcase[*T] : *T;
+
+        if ( ws )
+            ws->probes += KTrieKidProbes(f, c);
+
+        if ( !(i = KTrieFindKid(kt, f, c)) )
+            break;
+    }
+
+    if ( ws )
+    {
+        ws->steps += depth;
+
+        if ( depth > ws->max_depth )
+            ws->max_depth = depth;
     }
 
     return nfound;
 }
 
 /*
+*   Search - Algorithm
+*
+*   This routine will log any substring of T that matches a keyword,
+*   and processes all prefix matches. This is used for generic
+*   pattern searching with a set of keywords and a body of text.
+*
+*
+*
+*   kt- Trie Structure
+*   T - text, case is folded as the nocase trie is walked
+*   bT- start of text
+*   n - remaining text length
+*   ws- walk statistics, null if not counted
 *
+*   returns:
+*   # pattern matches
 */
-static inline int KTrieSearchNoBC(
-    KTRIE_STRUCT* ks, const uint8_t* Tx, int n, MpseMatch match, void* context)
+static inline int KTriePrefixMatch(
+    KTRIE_STRUCT* kt, const uint8_t* T, const uint8_t* bT, int n,
+    MpseMatch match, void* context, KTRIE_WALKSTATS* ws)
 {
     int nfound = 0;
-    const uint8_t* T, * bT;
+    uint32_t i;
+
+    if ( ws )
+        ws->attempts++;
+
+    /* Check if any keywords start with this character */
+    if ( (i = kt->froot[ *T ]) )
+        nfound += KTrieWalk(kt, i, T, (int)(T - bT), n, true, match, context, ws);
 
-    ConvertCaseEx(Tnocase, Tx, n);
+    if ( kt->ncase and (i = kt->fcroot[ *T ]) )
+        nfound += KTrieWalk(kt, i, T, (int)(T - bT), n, false, match, context, ws);
 
-    T  = Tnocase;
-    bT = T;
+    return nfound;
+}
+
+/*
+*
+*/
+static inline int KTrieSearchNoBC(
+    KTRIE_STRUCT* ks, const uint8_t* T, int n, MpseMatch match, void* context,
+    KTRIE_WALKSTATS* ws)
+{
+    int nfound = 0;
+    const uint8_t* bT = T;
 
-    for (; n>0; n--, T++, Tx++ )
+    for (; n>0; n--, T++ )
     {
-        nfound += KTriePrefixMatch(ks, T, Tx, bT, n, match, context);
+        nfound += KTriePrefixMatch(ks, T, bT, n, match, context, ws);
     }
 
     return nfound;
@@ -633,47 +2586,402 @@ static inline int KTrieSearchNoBC(
 *
 */
 static inline int KTrieSearchBC(
-    KTRIE_STRUCT* ks, const uint8_t* Tx, int n, MpseMatch match, void* context)
+    KTRIE_STRUCT* ks, const uint8_t* T, int n, MpseMatch match, void* context,
+    KTRIE_WALKSTATS* ws)
 {
     const uint8_t* Tend;
-    const uint8_t* T, * bT;
+    const uint8_t* bT = T;
     int nfound  = 0;
-    short* bcShift = (short*)ks->bcShift;
+    const unsigned short* bcShift = ks->bcShift;
     int bcSize  = ks->bcSize;
 
-    ConvertCaseEx(Tnocase, Tx, n);
-
-    T  = Tnocase;
-    bT = T;
-
     Tend = T + n - bcSize;
 
     bcSize--;
 
-    for (; T <= Tend; n--, T++, Tx++ )
+    for (; T <= Tend; T++ )
     {
         int tshift;
 
         while ( (tshift = bcShift[ *( T + bcSize ) ]) > 0 )
         {
+            if ( ws )
+            {
+                ws->shifts++;
+                ws->shift_bytes += tshift;
+            }
+
             T  += tshift;
-            Tx += tshift;
             if ( T > Tend )
                 return nfound;
         }
 
-        nfound += KTriePrefixMatch(ks, T, Tx, bT, n, match, context);
+        nfound += KTriePrefixMatch(ks, T, bT, n - (int)(T - bT), match, context, ws);
     }
 
     return nfound;
 }
 
-int KTrieSearch(
-    KTRIE_STRUCT* ks, const uint8_t* T, int n, MpseMatch match, void* context)
+/*
+*  Next position at which a pattern may start.  Positions skipped by the
+*  q-gram shift can't start a long pattern so they are only checked for
+*  the 1st byte of a short one.  Past the last start of a long pattern
+*  only the short ones are left.
+*/
+static inline bool KTrieWMShort(const KTRIE_STRUCT* ks, uint8_t c)
+{
+    return ks->wmshort[c >> 3] & (1 << (c & 7));
+}
+
+static inline const uint8_t* KTrieWMNext(
+    const KTRIE_STRUCT* ks, const uint8_t* T, const uint8_t* Tend)
+{
+    const uint8_t* Tlong = Tend + ks->bcSize - 1 - ks->wmSize;
+    int last = ks->wmSize - 1;
+
+    while ( T <= Tlong )
+    {
+        unsigned tshift = ks->wmShift[ KTRIE_WM_INDEX(T[last - 1], T[last]) ];
+
+        if ( !tshift )
+            return T;
+
+        for ( const uint8_t* Ts = T + tshift; T < Ts; T++ )
+        {
+            if ( KTrieWMShort(ks, *T) )
+                return T;
+        }
+    }
+
+    for ( ; T < Tend; T++ )
+    {
+        if ( KTrieWMShort(ks, *T) )
+            return T;
+    }
+
+    return Tend;
+}
+
+/*
+*  Search with the q-gram shifts
+*/
+static inline int KTrieSearchWM(
+    KTRIE_STRUCT* ks, const uint8_t* T, int n, MpseMatch match, void* context,
+    KTRIE_WALKSTATS* ws)
+{
+    const uint8_t* bT = T;
+    const uint8_t* Tend = T + n - ks->bcSize + 1;
+    int nfound = 0;
+
+    while ( (T = KTrieWMNext(ks, T, Tend)) < Tend )
+    {
+        nfound += KTriePrefixMatch(ks, T, bT, n - (int)(T - bT), match, context, ws);
+        T++;
+    }
+
+    return nfound;
+}
+
+/*
+*  Search only the positions that survive the vector scan filter
+*/
+static inline int KTrieSearchScan(
+    KTRIE_STRUCT* ks, const uint8_t* T, int n, MpseMatch match, void* context,
+    KTRIE_WALKSTATS* ws)
+{
+    const uint8_t* bT = T;
+    const uint8_t* Tend = T + n - ks->bcSize + 1;
+    int nfound = 0;
+
+    while ( (T = ks->scan(ks, T, Tend)) < Tend )
+    {
+        nfound += KTriePrefixMatch(ks, T, bT, n - (int)(T - bT), match, context, ws);
+        T++;
+    }
+
+    return nfound;
+}
+
+static inline int KTrieSearchPath(
+    KTRIE_STRUCT* ks, const uint8_t* T, int n, MpseMatch match, void* context,
+    KTRIE_WALKSTATS* ws)
 {
+    if ( ks->method == KTRIE_METHOD_NOBC )
+        return KTrieSearchNoBC(ks, T, n, match, context, ws);
+
+    if ( ks->method == KTRIE_METHOD_BC )
+        return KTrieSearchBC(ks, T, n, match, context, ws);
+
+    if ( ks->scan )
+        return KTrieSearchScan(ks, T, n, match, context, ws);
+
+    if ( ks->wmShift )
+        return KTrieSearchWM(ks, T, n, match, context, ws);
+
     if ( ks->bcSize < 3 )
-        return KTrieSearchNoBC(ks, T, n, match, context);
+        return KTrieSearchNoBC(ks, T, n, match, context, ws);
     else
-        return KTrieSearchBC(ks, T, n, match, context);
+        return KTrieSearchBC(ks, T, n, match, context, ws);
+}
+
+int KTrieSearch(
+    KTRIE_STRUCT* ks, const uint8_t* T, int n, MpseMatch match, void* context)
+{
+    if ( !ks->fnode or n < ks->bcSize )
+        return 0;
+
+    if ( !ks->config.walk_stats )
+        return KTrieSearchPath(ks, T, n, match, context, nullptr);
+
+    KTRIE_WALKSTATS ws = { };
+    ws.bytes = n;
+
+    int nfound = KTrieSearchPath(ks, T, n, match, context, &ws);
+    KTrieAddWalkStats(&ws);
+
+    return nfound;
+}
+
+/*
+*  Batched search - the next match start of each buffer is found and its
+*  root node prefetched, then the other buffers are serviced before the
+*  trie is walked from that start so the node fetch latency is hidden.
+*/
+static inline const uint8_t* KTrieNextStart(
+    const KTRIE_STRUCT* ks, const uint8_t* T, const uint8_t* Tend)
+{
+    if ( ks->method == KTRIE_METHOD_NOBC )
+        return T;
+
+    if ( ks->scan and ks->method != KTRIE_METHOD_BC )
+        return ks->scan(ks, T, Tend);
+
+    if ( ks->bcSize >= 3 or ks->method == KTRIE_METHOD_BC )
+    {
+        int last = ks->bcSize - 1;
+        int tshift;
+
+        while ( T < Tend and (tshift = ks->bcShift[ T[last] ]) > 0 )
+            T += tshift;
+
+        return T < Tend ? T : Tend;
+    }
+
+    if ( ks->wmShift )
+        return KTrieWMNext(ks, T, Tend);
+
+    return T;
+}
+
+static inline void KTriePrefetch(const KTRIE_STRUCT* ks, const uint8_t* T)
+{
+    KTRIE_PREFETCH(ks->fnode + ks->froot[ *T ]);
+
+    if ( ks->ncase )
+        KTRIE_PREFETCH(ks->fnode + ks->fcroot[ *T ]);
+}
+
+struct KTRIELANE
+{
+    KTRIE_BATCH* job;
+    const uint8_t* T;
+    const uint8_t* Tend;
+};
+
+static bool KTrieStartLane(KTRIELANE* lane, KTRIE_BATCH* job)
+{
+    job->nfound = 0;
+
+    KTRIE_STRUCT* ks = job->ks;
+
+    if ( !ks->fnode or job->n < ks->bcSize )
+        return false;
+
+    lane->job = job;
+    lane->Tend = job->T + job->n - ks->bcSize + 1;
+    lane->T = KTrieNextStart(ks, job->T, lane->Tend);
+
+    if ( lane->T >= lane->Tend )
+        return false;
+
+    KTriePrefetch(ks, lane->T);
+    return true;
+}
+
+void KTrieSearchBatch(KTRIE_BATCH* jobs, unsigned njobs, MpseMatch match, void* context)
+{
+    KTRIELANE lanes[KTRIE_BATCH_LANES];
+    unsigned active = 0;
+    unsigned next = 0;
+
+    /* skips aren't counted here since the lanes share KTrieNextStart */
+    KTRIE_WALKSTATS ws = { };
+    bool walk_stats = false;
+
+    for ( unsigned k = 0; k < njobs; k++ )
+    {
+        if ( jobs[k].ks->config.walk_stats and jobs[k].ks->fnode )
+        {
+            ws.bytes += jobs[k].n;
+            walk_stats = true;
+        }
+    }
+
+    while ( active < KTRIE_BATCH_LANES and next < njobs )
+    {
+        if ( KTrieStartLane(lanes + active, jobs + next++) )
+            active++;
+    }
+
+    while ( active )
+    {
+        unsigned l = 0;
+
+        while ( l < active )
+        {
+            KTRIELANE* lane = lanes + l;
+            KTRIE_BATCH* job = lane->job;
+            KTRIE_STRUCT* ks = job->ks;
+
+            job->nfound += KTriePrefixMatch(
+                ks, lane->T, job->T, job->n - (int)(lane->T - job->T), match, context,
+                ks->config.walk_stats ? &ws : nullptr);
+
+            lane->T = KTrieNextStart(ks, lane->T + 1, lane->Tend);
+
+            if ( lane->T < lane->Tend )
+            {
+                KTriePrefetch(ks, lane->T);
+                l++;
+                continue;
+            }
+
+            /* this buffer is done, start another or drop the lane */
+            bool started = false;
+
+            while ( !started and next < njobs )
+                started = KTrieStartLane(lane, jobs + next++);
+
+            if ( !started )
+                *lane = lanes[--active];
+        }
+    }
+
+    if ( walk_stats )
+        KTrieAddWalkStats(&ws);
+}
+
+/*
+*  Stream search - first the positions carried over from the previous
+*  buffer are continued into this one, then the buffer is searched as
+*  usual, and finally walks are (re)started at each of the last maxSize-1
+*  positions without reporting to record those still open at the end.
+*  Matches within the buffer were reported by the search so the final
+*  walks needn't report.
+*/
+static inline int KTrieWalkOpen(
+    KTRIE_STRUCT* kt, uint32_t i, const uint8_t* T, int n, bool nocase,
+    bool report, MpseMatch match, void* context, uint32_t* open)
+{
+    const uint8_t* bT = T;
+    int nfound = 0;
+
+    *open = 0;
+
+    while ( true )
+    {
+        const KTRIEFNODE* f = kt->fnode + i;
+
+        T++;
+        n--;
+
+        if ( report and f->match )
+        {
+            KTRIEPATTERN* pk = kt->fmatch[f->match - 1];
+            nfound++;
+
+            if (match (pk->user, pk->rule_option_tree, (int)(T - bT), context, pk->neg_list) > 0)
+                return nfound;
+        }
+
+        if ( !f->nkids )
+            break;
+
+        if ( !n )
+        {
+            *open = i;
+            break;
+        }
+
+        if ( !(i = KTrieFindKid(kt, f, nocase ? xlatcase[*T] : *T)) )
+            break;
+    }
+
+    return nfound;
 }
 
+static inline void KTrieStreamAdd(KTRIE_STREAM* st, uint32_t i, bool nocase)
+{
+    if ( i and st->nactive < KTRIE_STREAM_MAX )
+        st->active[st->nactive++] = nocase ? i : (i | KTRIE_STREAM_CASE);
+}
+
+int KTrieSearchStream(
+    KTRIE_STRUCT* ks, KTRIE_STREAM* st, const uint8_t* T, int n, MpseMatch match, void* context)
+{
+    if ( !ks->fnode or n < 1 )
+        return 0;
+
+    if ( st->ks != ks )
+    {
+        st->ks = ks;
+        st->nactive = 0;
+    }
+
+    int nfound = 0;
+    uint32_t open;
+
+    /* continue the open positions */
+    unsigned nprev = st->nactive;
+    uint32_t prev[KTRIE_STREAM_MAX];
+
+    memcpy(prev, st->active, nprev * sizeof(prev[0]));
+    st->nactive = 0;
+
+    for ( unsigned k = 0; k < nprev; k++ )
+    {
+        bool nocase = !(prev[k] & KTRIE_STREAM_CASE);
+        const KTRIEFNODE* f = ks->fnode + (prev[k] & ~KTRIE_STREAM_CASE);
+        uint32_t i = KTrieFindKid(ks, f, nocase ? xlatcase[*T] : *T);
+
+        if ( i )
+        {
+            nfound += KTrieWalkOpen(ks, i, T, n, nocase, true, match, context, &open);
+            KTrieStreamAdd(st, open, nocase);
+        }
+    }
+
+    nfound += KTrieSearch(ks, T, n, match, context);
+
+    /* record positions still open at the end */
+    int start = n - ks->maxSize + 1;
+
+    for ( int k = start > 0 ? start : 0; k < n; k++ )
+    {
+        uint32_t i;
+
+        if ( (i = ks->froot[ T[k] ]) )
+        {
+            KTrieWalkOpen(ks, i, T + k, n - k, true, false, match, context, &open);
+            KTrieStreamAdd(st, open, true);
+        }
+
+        if ( ks->ncase and (i = ks->fcroot[ T[k] ]) )
+        {
+            KTrieWalkOpen(ks, i, T + k, n - k, false, false, match, context, &open);
+            KTrieStreamAdd(st, open, false);
+        }
+    }
+
+    return nfound;
+}
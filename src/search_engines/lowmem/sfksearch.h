@@ -23,6 +23,7 @@
 
 // ksearch.h - Trie based multi-pattern matcher
 
+#include <cstddef>
 #include <cstdint>
 #include "search_engines/search_common.h"
 
@@ -36,16 +37,30 @@ struct KTRIEPATTERN
     KTRIEPATTERN* next; /* global list of all patterns*/
     KTRIEPATTERN* mnext; /* matching list of duplicate keywords*/
 
-    uint8_t* P;  /* no case*/
-    uint8_t* Pcase; /* case sensitive*/
+    uint8_t* P;  /* no case, interned*/
+    uint8_t* Pcase; /* case sensitive, interned*/
 
     void* user;
     void* rule_option_tree;
     void* neg_list;
 
     int n;
-    int nocase;
-    int negative;
+    uint8_t nocase;
+    uint8_t negative;
+    uint8_t pending;    /* KTRIE_PENDING_*, work for KTrieUpdate*/
+};
+
+#define KTRIE_PENDING_INSERT 0x01   /* added since compiling*/
+#define KTRIE_PENDING_STATE  0x02   /* match list changed since compiling*/
+
+/*
+*  Intern table entry - a distinct pattern string in the trie arena
+*/
+struct KTRIEINTERN
+{
+    uint8_t* s;
+    uint32_t n;
+    uint32_t hash;
 };
 
 struct KTRIENODE
@@ -58,29 +73,134 @@ struct KTRIENODE
     KTRIEPATTERN* pkeyword;
 };
 
+/*
+*  Flattened trie node - children of a node are stored contiguously,
+*  sorted by edge, starting at index kids.  The edges of small fan-out
+*  nodes are kept inline so the walk doesn't touch the child nodes.
+*/
+#define KTRIE_INLINE_KIDS 6
+
+/*
+*  Wide nodes near the root may instead have a direct child table, with
+*  KTRIE_DENSE set in nkids and the table index in edge[2..5]
+*/
+#define KTRIE_DENSE 0x8000
+
+struct KTRIEFNODE
+{
+    uint32_t kids;      /* index of 1st child*/
+    uint32_t match;     /* 1 + index of match list, 0 if none*/
+    uint16_t nkids;
+    uint8_t edge[KTRIE_INLINE_KIDS];
+};
+
+/*
+*  Arena chunk - all memory of a trie is carved from a list of chunks
+*  that are only released as a whole
+*/
+struct KTRIECHUNK
+{
+    KTRIECHUNK* next;
+    unsigned size;
+    unsigned used;
+};
+
 #define KTRIE_ROOT_NODES     256
 
+struct KTRIE_CONFIG
+{
+    unsigned compile_threads;   /* 0 = one per cpu*/
+    const char* cache_dir;      /* compiled trie images, null = none*/
+    unsigned dense_levels;      /* levels that may have direct child tables*/
+    size_t memory_budget;       /* bytes per trie for adding them, 0 = no limit*/
+    bool walk_stats;            /* count KTRIE_WALKSTATS when searching*/
+    bool share;                 /* use one image for tries with the same patterns*/
+    bool incremental;           /* keep the linked trie for KTrieUpdate*/
+};
+
+struct KTRIE_STRUCT;
+
+/* returns the next possible match start in [T, Tend) or Tend if none */
+typedef const uint8_t* (* KTRIE_SCAN)(const KTRIE_STRUCT*, const uint8_t* T, const uint8_t* Tend);
+
 struct KTRIE_STRUCT
 {
     KTRIEPATTERN* patrn; /* List of patterns, built as they are added*/
     KTRIENODE* root[KTRIE_ROOT_NODES];   /* KTrie nodes*/
+    KTRIENODE* croot[KTRIE_ROOT_NODES];  /* case sensitive KTrie nodes*/
 
     const struct MpseAgent* agent;
+    KTRIE_CONFIG config;
+
+    KTRIECHUNK* mem;        /* patterns and flattened trie*/
+    KTRIECHUNK* nodemem;    /* linked nodes, released once flattened*/
+    KTRIECHUNK* flatmem;    /* flattened trie, released if shared*/
+
+    KTRIEINTERN* intern;    /* pattern strings, only while adding*/
+    unsigned intern_size;
+    unsigned intern_count;
+
+    /* incremental tries only, see KTrieUpdate */
+    KTRIENODE* nodefree;    /* pruned nodes for reuse*/
+    KTRIEPATTERN* patfree;  /* removed patterns for reuse*/
+    unsigned removed;       /* patterns removed since the last update*/
 
-    int memory;
+    void* image;            /* compiled trie image, if mapped or shared*/
+    size_t image_size;
+    uint64_t image_hash;    /* of the patterns, the key of shared images*/
+    bool image_shared;
+    bool image_loaded;      /* from cache_dir*/
+
+    size_t memory;           /* bytes allocated for this trie*/
     int nchars;
     int npats;
     int duplicates;
-    int method;
+    int method;              /* KTRIE_METHOD_* */
     int end_states;          /* should equal npats - duplicates*/
+    int ncase;               /* case sensitive patterns*/
 
     int bcSize;
+    int maxSize;            /* largest pattern size*/
     unsigned short bcShift[KTRIE_ROOT_NODES];
+
+    /* q-gram shifts over the long patterns when there are short ones */
+    int wmSize;             /* shortest long pattern*/
+    uint8_t* wmShift;       /* null if not used*/
+    uint8_t wmshort[32];    /* bitmap of 1st bytes of short patterns*/
+
+    /* flattened trie, built by KTrieCompile; node 0 is unused */
+    KTRIEFNODE* fnode;
+    uint8_t* fedge;         /* edge into each node*/
+    KTRIEPATTERN** fmatch;  /* match lists*/
+
+    uint8_t* fdense;        /* direct child tables, 1 + child offset*/
+
+    uint32_t fnodes;
+    uint32_t fmatches;
+    uint32_t fdenses;
+    uint32_t froot[KTRIE_ROOT_NODES];
+    uint32_t fcroot[KTRIE_ROOT_NODES];
+
+    /* vector scan filter, null if not supported or not selective */
+    KTRIE_SCAN scan;
+
+    uint8_t fbset[32];      /* bitmap of 1st pattern bytes*/
+    uint8_t sbset[32];      /* bitmap of 2nd pattern bytes*/
+    uint8_t fbmask[32];     /* nibble lookup tables for the above*/
+    uint8_t sbmask[32];
 };
 
 void KTrie_init_xlatcase();
 
-KTRIE_STRUCT* KTrieNew(int method, const MpseAgent*);
+/*
+*  KTrieNew methods - by default the search picks its path from the
+*  patterns; the others force a path for comparison
+*/
+#define KTRIE_METHOD_AUTO 0
+#define KTRIE_METHOD_NOBC 1     /* walk at every position*/
+#define KTRIE_METHOD_BC   2     /* bad character shifts only*/
+
+KTRIE_STRUCT* KTrieNew(int method, const MpseAgent*, const KTRIE_CONFIG* = nullptr);
 
 int KTrieAddPattern(
     KTRIE_STRUCT*, const uint8_t* P, unsigned n,
@@ -88,10 +208,92 @@ int KTrieAddPattern(
 
 int KTrieCompile(snort::SnortConfig*, KTRIE_STRUCT*);
 
+/*
+*  Incremental changes - tries compiled with incremental set keep the
+*  linked trie so patterns may be added with KTrieAddPattern and removed
+*  with KTrieRemovePattern after compiling.  KTrieUpdate then applies
+*  the changes without inserting the other patterns again or rebuilding
+*  their match states.  The trie must not be searched between the first
+*  change and KTrieUpdate.
+*/
+int KTrieRemovePattern(
+    KTRIE_STRUCT*, const uint8_t* P, unsigned n,
+    bool nocase, bool negative, void* id);
+
+int KTrieUpdate(snort::SnortConfig*, KTRIE_STRUCT*);
+
 int KTrieSearch(KTRIE_STRUCT*, const uint8_t* T,  int n, MpseMatch, void* context);
 
-unsigned int KTrieMemUsed();
-void KTrieInitMemUsed();
+/* one buffer of a batched search */
+struct KTRIE_BATCH
+{
+    KTRIE_STRUCT* ks;
+    const uint8_t* T;
+    int n;
+    int nfound;
+};
+
+void KTrieSearchBatch(KTRIE_BATCH*, unsigned nbatch, MpseMatch, void* context);
+
+/*
+*  Stream state - the trie positions reached at the end of the previous
+*  buffer by matches that may continue in the next.  Positions are node
+*  indices, KTRIE_STREAM_CASE marks those in the case sensitive trie.
+*  Matches that need more than KTRIE_STREAM_MAX partial positions to be
+*  carried at once are not found across the boundary.  The caller owns
+*  one zeroed state per stream and passes it with each buffer in order.
+*/
+#define KTRIE_STREAM_MAX  64
+#define KTRIE_STREAM_CASE 0x80000000
+
+struct KTRIE_STREAM
+{
+    const KTRIE_STRUCT* ks;
+    unsigned nactive;
+    uint32_t active[KTRIE_STREAM_MAX];
+};
+
+int KTrieSearchStream(
+    KTRIE_STRUCT*, KTRIE_STREAM*, const uint8_t* T, int n, MpseMatch, void* context);
+
+struct KTRIE_MEMSTATS
+{
+    uint64_t tries;
+    uint64_t patterns;
+    uint64_t nodes;
+    uint64_t bytes;
+    uint64_t max_bytes;     /* largest single trie*/
+    uint64_t images;        /* tries mapped from cache_dir*/
+
+    uint64_t compile_usecs;     /* total KTrieCompile time*/
+    uint64_t max_compile_usecs;
+    uint64_t delete_usecs;      /* total KTrieDelete time*/
+
+    uint64_t shared;        /* tries using an image shared with another*/
+};
+
+uint64_t KTrieMemUsed();
+void KTrieGetMemStats(KTRIE_MEMSTATS*);
+
+/*
+*  Walk totals over all searches of tries with walk_stats set
+*/
+struct KTRIE_WALKSTATS
+{
+    uint64_t bytes;             /* searched*/
+    uint64_t attempts;          /* prefix matches started*/
+    uint64_t steps;             /* nodes visited by walks*/
+    uint64_t probes;            /* edges compared finding the next node*/
+    uint64_t shifts;            /* bad character shifts taken*/
+    uint64_t shift_bytes;       /* bytes skipped by them*/
+    uint64_t max_depth;         /* longest walk*/
+
+    uint64_t match_continue;    /* match callback returned 0*/
+    uint64_t match_stop;        /* returned > 0*/
+    uint64_t match_negative;    /* returned < 0*/
+};
+
+void KTrieGetWalkStats(KTRIE_WALKSTATS*);
 
 void KTrieDelete(KTRIE_STRUCT*);
 int KTriePatternCount(KTRIE_STRUCT*);
@@ -0,0 +1,893 @@
+//--------------------------------------------------------------------------
+// Copyright (C) 2025-2025 Cisco and/or its affiliates. All rights reserved.
+//
+// This program is free software; you can redistribute it and/or modify it
+// under the terms of the GNU General Public License Version 2 as published
+// by the Free Software Foundation.  You may not use, modify or distribute
+// this program under any other version of the GNU General Public License.
+//
+// This program is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along
+// with this program; if not, write to the Free Software Foundation, Inc.,
+// 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+//--------------------------------------------------------------------------
+
+// sfksearch_test.cc - unit tests of the ktrie
+
+#include <dirent.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "sfksearch.h"
+
+#include <CppUTest/CommandLineTestRunner.h>
+#include <CppUTest/TestHarness.h>
+
+//--------------------------------------------------------------------------
+// stubs
+//--------------------------------------------------------------------------
+
+static int test_build_tree(snort::SnortConfig*, void*, void**)
+{ return 0; }
+
+static int test_negate_list(void*, void**)
+{ return 0; }
+
+static void test_user_free(void*) { }
+static void test_tree_free(void**) { }
+static void test_list_free(void**) { }
+
+static MpseAgent s_agent =
+{
+    test_build_tree,
+    test_negate_list,
+    test_user_free,
+    test_tree_free,
+    test_list_free
+};
+
+// the ids of the patterns are their indices in the list added
+static int test_match(void* user, void*, int, void* context, void*)
+{
+    ((std::vector<unsigned>*)context)->push_back((unsigned)(uintptr_t)user);
+    return 0;
+}
+
+static KTRIE_STRUCT* test_compile(
+    const std::vector<std::string>& pats, const KTRIE_CONFIG* config = nullptr)
+{
+    KTRIE_STRUCT* ks = KTrieNew(KTRIE_METHOD_AUTO, &s_agent, config);
+
+    for ( unsigned i = 0; i < pats.size(); i++ )
+    {
+        KTrieAddPattern(
+            ks, (const uint8_t*)pats[i].data(), pats[i].size(), false, false, (void*)(uintptr_t)i);
+    }
+    KTrieCompile(nullptr, ks);
+    return ks;
+}
+
+static KTRIE_STRUCT* test_compile_shared(const std::vector<std::string>& pats)
+{
+    KTRIE_CONFIG config = { };
+    config.compile_threads = 1;
+    config.share = true;
+
+    return test_compile(pats, &config);
+}
+
+static std::vector<unsigned> test_search(KTRIE_STRUCT* ks, const char* s)
+{
+    std::vector<unsigned> found;
+    KTrieSearch(ks, (const uint8_t*)s, strlen(s), test_match, &found);
+    return found;
+}
+
+static std::vector<unsigned> test_search(KTRIE_STRUCT* ks, const std::string& s)
+{
+    std::vector<unsigned> found;
+    KTrieSearch(ks, (const uint8_t*)s.data(), s.size(), test_match, &found);
+    std::sort(found.begin(), found.end());
+    return found;
+}
+
+// the ids of every occurrence of the patterns, as the trie reports them
+static std::vector<unsigned> test_naive(
+    const std::vector<std::string>& pats, const std::string& s)
+{
+    std::vector<unsigned> found;
+
+    for ( unsigned i = 0; i < pats.size(); i++ )
+    {
+        for ( size_t k = s.find(pats[i]); k != std::string::npos; k = s.find(pats[i], k + 1) )
+            found.push_back(i);
+    }
+    std::sort(found.begin(), found.end());
+    return found;
+}
+
+//--------------------------------------------------------------------------
+// an agent whose trees are the sorted ids of the patterns they were
+// built from, so searches show the match state of each node
+//--------------------------------------------------------------------------
+
+static unsigned s_build_calls = 0;
+static int s_live_trees = 0;
+static std::vector<unsigned> s_build_order;
+
+static int tree_build_tree(snort::SnortConfig*, void* user, void** tree)
+{
+    s_build_calls++;
+    s_build_order.push_back((unsigned)(uintptr_t)user);
+
+    if ( !user )
+        return 0;
+
+    if ( !*tree )
+    {
+        *tree = new std::vector<unsigned>;
+        s_live_trees++;
+    }
+    std::vector<unsigned>* ids = (std::vector<unsigned>*)*tree;
+    ids->push_back((unsigned)(uintptr_t)user);
+    std::sort(ids->begin(), ids->end());
+    return 0;
+}
+
+static void tree_tree_free(void** tree)
+{
+    delete (std::vector<unsigned>*)*tree;
+    *tree = nullptr;
+    s_live_trees--;
+}
+
+static MpseAgent s_tree_agent =
+{
+    tree_build_tree,
+    test_negate_list,
+    test_user_free,
+    tree_tree_free,
+    test_list_free
+};
+
+// each match is recorded as "end offset:ids of the tree"
+static int tree_match(void*, void* tree, int index, void* context, void*)
+{
+    std::string s = std::to_string(index) + ":";
+
+    if ( tree )
+    {
+        for ( unsigned id : *(std::vector<unsigned>*)tree )
+            s += " " + std::to_string(id);
+    }
+    ((std::vector<std::string>*)context)->push_back(s);
+    return 0;
+}
+
+static void tree_add(KTRIE_STRUCT* ks, const char* pat, unsigned id)
+{ KTrieAddPattern(ks, (const uint8_t*)pat, strlen(pat), false, false, (void*)(uintptr_t)id); }
+
+static void tree_remove(KTRIE_STRUCT* ks, const char* pat, unsigned id)
+{
+    int rval = KTrieRemovePattern(
+        ks, (const uint8_t*)pat, strlen(pat), false, false, (void*)(uintptr_t)id);
+    CHECK(rval == 0);
+}
+
+static std::vector<std::string> tree_search(KTRIE_STRUCT* ks, const char* s)
+{
+    std::vector<std::string> found;
+    KTrieSearch(ks, (const uint8_t*)s, strlen(s), tree_match, &found);
+    std::sort(found.begin(), found.end());
+    return found;
+}
+
+//--------------------------------------------------------------------------
+
+TEST_GROUP(ktrie_kids)
+{
+    void setup() override
+    { KTrie_init_xlatcase(); }
+};
+
+// a node with more kids than fit inline is searched by bisecting its
+// kids; a byte greater than all of them must not match the edge that
+// follows the last kid
+TEST(ktrie_kids, past_last_kid)
+{
+    std::vector<std::string> pats = { "ab", "ac", "ad", "ae", "af", "ag", "ah", "zz" };
+    KTRIE_STRUCT* ks = test_compile(pats);
+
+    CHECK(test_search(ks, "az").empty());
+    CHECK(test_search(ks, "ai").empty());
+
+    std::vector<unsigned> found = test_search(ks, "ah");
+    CHECK(found.size() == 1 and found[0] == 6);
+
+    found = test_search(ks, "zz");
+    CHECK(found.size() == 1 and found[0] == 7);
+
+    KTrieDelete(ks);
+}
+
+TEST(ktrie_kids, every_kid)
+{
+    std::vector<std::string> pats = { "ab", "ac", "ad", "ae", "af", "ag", "ah", "zz" };
+    KTRIE_STRUCT* ks = test_compile(pats);
+
+    for ( unsigned i = 0; i < pats.size(); i++ )
+    {
+        std::vector<unsigned> found = test_search(ks, pats[i].c_str());
+        CHECK(found.size() == 1 and found[0] == i);
+    }
+    CHECK(test_search(ks, "aa").empty());
+
+    KTrieDelete(ks);
+}
+
+//--------------------------------------------------------------------------
+
+TEST_GROUP(ktrie_case)
+{
+    KTRIE_STRUCT* ks = nullptr;
+
+    void setup() override
+    {
+        KTrie_init_xlatcase();
+        ks = KTrieNew(KTRIE_METHOD_AUTO, &s_agent);
+    }
+
+    void teardown() override
+    { KTrieDelete(ks); }
+
+    void add(const char* pat, bool nocase, unsigned id)
+    { KTrieAddPattern(ks, (const uint8_t*)pat, strlen(pat), nocase, false, (void*)(uintptr_t)id); }
+};
+
+TEST(ktrie_case, exact)
+{
+    add("ABC", false, 1);
+    KTrieCompile(nullptr, ks);
+
+    CHECK(test_search(ks, "abc").empty());
+    CHECK(test_search(ks, "xAbC").empty());
+
+    std::vector<unsigned> found = test_search(ks, "xxABC");
+    CHECK(found.size() == 1 and found[0] == 1);
+}
+
+// the same bytes with and without nocase are different patterns and
+// each is reported where it matches
+TEST(ktrie_case, both)
+{
+    add("abc", true, 1);
+    add("abc", false, 2);
+    KTrieCompile(nullptr, ks);
+
+    std::vector<unsigned> found = test_search(ks, "abc");
+    std::sort(found.begin(), found.end());
+    CHECK(found.size() == 2 and found[0] == 1 and found[1] == 2);
+
+    found = test_search(ks, "ABC");
+    CHECK(found.size() == 1 and found[0] == 1);
+}
+
+//--------------------------------------------------------------------------
+
+TEST_GROUP(ktrie_scan)
+{
+    void setup() override
+    { KTrie_init_xlatcase(); }
+};
+
+// buffers of every length up to past two 64 byte blocks with matches at
+// the start, at the end and across the block boundaries must give the
+// same results with the vector scan and with the scalar walk
+TEST(ktrie_scan, same_as_scalar)
+{
+    std::vector<std::string> pats = { "needle", "zebra", "\xe9t\xe9", "qq" };
+    KTRIE_STRUCT* ks = test_compile(pats);
+
+    if ( !ks->scan )
+    {
+        KTrieDelete(ks);
+        return;  // no vector support here
+    }
+    KTRIE_SCAN scan = ks->scan;
+
+    for ( unsigned n = 12; n <= 140; n++ )
+    {
+        std::string buf = "needle" + std::string(n - 11, '.') + "zebra";
+
+        if ( n > 70 )
+            buf.replace(62, 3, "\xe9t\xe9");
+
+        for ( unsigned k = 15; k + 1 < n - 5; k += 16 )
+        {
+            if ( buf[k] == '.' and buf[k + 1] == '.' )
+                buf.replace(k, 2, "qq");
+        }
+
+        std::vector<unsigned> expect = test_naive(pats, buf);
+        CHECK(expect.front() == 0 and expect[1] == 1);
+
+        ks->scan = scan;
+        CHECK(test_search(ks, buf) == expect);
+
+        ks->scan = nullptr;
+        CHECK(test_search(ks, buf) == expect);
+    }
+
+    ks->scan = scan;
+    KTrieDelete(ks);
+}
+
+// with 1 and 2 byte patterns the q-gram shifts over the long patterns
+// and the bitmap of short 1st bytes pick the walk starts; they must
+// find what walking at every position does
+TEST(ktrie_scan, wm_shifts)
+{
+    std::vector<std::string> pats =
+        { "x", "Q", "ab", "zzzz", "wumanber", "shiftable", "qgramqgram" };
+    KTRIE_STRUCT* ks = test_compile(pats);
+    CHECK(ks->wmShift and ks->wmSize == 4);
+
+    const char* alpha = "abqxzwumnershiftQg.";
+    unsigned seed = 12345;
+    std::string text;
+
+    for ( unsigned i = 0; i < 3000; i++ )
+    {
+        seed = seed * 1103515245 + 12345;
+        unsigned r = (seed >> 16) % 64;
+
+        if ( r < 3 )
+            text += pats[3 + r];
+        else
+            text += alpha[r % strlen(alpha)];
+    }
+
+    KTRIE_SCAN scan = ks->scan;
+    uint8_t* shifts = ks->wmShift;
+    ks->scan = nullptr;
+
+    for ( unsigned n = 1; n < text.size(); n += n < 64 ? 1 : 97 )
+    {
+        std::string buf = text.substr((n * 31) % (text.size() - n), n);
+        std::vector<unsigned> expect = test_naive(pats, buf);
+
+        CHECK(test_search(ks, buf) == expect);
+
+        std::vector<unsigned> found;
+        KTRIE_BATCH job = { ks, (const uint8_t*)buf.data(), (int)buf.size(), 0 };
+        KTrieSearchBatch(&job, 1, test_match, &found);
+        std::sort(found.begin(), found.end());
+        CHECK(found == expect);
+
+        ks->wmShift = nullptr;
+        CHECK(test_search(ks, buf) == expect);
+        ks->wmShift = shifts;
+    }
+
+    ks->scan = scan;
+    KTrieDelete(ks);
+}
+
+//--------------------------------------------------------------------------
+
+TEST_GROUP(ktrie_dense)
+{
+    KTRIE_CONFIG config = { };
+    std::vector<std::string> pats;
+    std::string text;
+
+    void setup() override
+    {
+        KTrie_init_xlatcase();
+        config.compile_threads = 1;
+
+        // "a" has 20 kids at level 0, "bc" has 10 at level 1 and "z" has
+        // all 256, which is indexed without a table
+        for ( unsigned c = 0; c < 20; c++ )
+            pats.push_back(std::string("a") + (char)('A' + c * 3));
+
+        for ( unsigned c = 0; c < 10; c++ )
+            pats.push_back(std::string("bc") + (char)('0' + c));
+
+        for ( unsigned c = 0; c < 256; c++ )
+            pats.push_back(std::string("z") + (char)c);
+
+        for ( unsigned c = 0; c < 256; c++ )
+            text += std::string("a") + (char)c + "bc" + (char)c + "z" + (char)c + "b";
+    }
+
+    KTRIE_STRUCT* compile(unsigned levels, size_t budget)
+    {
+        config.dense_levels = levels;
+        config.memory_budget = budget;
+        return test_compile(pats, &config);
+    }
+};
+
+TEST(ktrie_dense, levels)
+{
+    KTRIE_STRUCT* ref = compile(0, 0);
+    CHECK(ref->fdenses == 0);
+
+    const KTRIEFNODE* z = ref->fnode + ref->fcroot['z'];
+    CHECK(z->nkids == KTRIE_ROOT_NODES);
+
+    std::vector<unsigned> expect = test_naive(pats, text);
+    CHECK(test_search(ref, text) == expect);
+
+    KTRIE_STRUCT* ks = compile(1, 0);
+    CHECK(ks->fdenses == 1);
+    CHECK(test_search(ks, text) == expect);
+    KTrieDelete(ks);
+
+    ks = compile(2, 0);
+    CHECK(ks->fdenses == 2);
+    CHECK(test_search(ks, text) == expect);
+
+    z = ks->fnode + ks->fcroot['z'];
+    CHECK(z->nkids == KTRIE_ROOT_NODES);
+    KTrieDelete(ks);
+
+    KTrieDelete(ref);
+}
+
+// a budget too tight for every table takes the shallowest and widest
+// ones that fit and still finds the same matches
+TEST(ktrie_dense, budget)
+{
+    KTRIE_STRUCT* ref = compile(0, 0);
+    std::vector<unsigned> expect = test_search(ref, text);
+    size_t base = ref->memory;
+    KTrieDelete(ref);
+
+    KTRIE_STRUCT* ks = compile(2, 1);
+    CHECK(ks->fdenses == 0);
+    CHECK(test_search(ks, text) == expect);
+    KTrieDelete(ks);
+
+    bool partial = false;
+
+    // the budget is checked against the memory before the tables, so
+    // try some around that of the trie without them
+    for ( size_t budget = base - 2048; budget <= base + 2048; budget += 32 )
+    {
+        ks = compile(2, budget);
+        CHECK(ks->fdenses <= 2);
+        CHECK(test_search(ks, text) == expect);
+
+        if ( ks->fdenses == 1 )
+        {
+            // the level 0 node is the one kept
+            const KTRIEFNODE* a = ks->fnode + ks->fcroot['a'];
+            CHECK(a->nkids & KTRIE_DENSE);
+            partial = true;
+        }
+        KTrieDelete(ks);
+    }
+    CHECK(partial);
+}
+
+//--------------------------------------------------------------------------
+
+TEST_GROUP(ktrie_image)
+{
+    KTRIE_CONFIG config = { };
+    std::vector<std::string> pats = { "abc", "abd", "xyz", "hello", "help", "q" };
+    char dir[64];
+
+    void setup() override
+    {
+        KTrie_init_xlatcase();
+
+        strcpy(dir, "/tmp/ktrie_test.XXXXXX");
+        CHECK(mkdtemp(dir));
+
+        config.compile_threads = 1;
+        config.cache_dir = dir;
+        config.dense_levels = 1;
+
+        // a wide node so the image has a dense table
+        for ( char c = 'a'; c <= 'z'; c++ )
+            pats.push_back(std::string("w") + c);
+    }
+
+    void teardown() override
+    {
+        std::string file = image();
+
+        if ( !file.empty() )
+            unlink(file.c_str());
+
+        rmdir(dir);
+    }
+
+    // the path of the only image in dir, if any
+    std::string image()
+    {
+        std::string file;
+        DIR* d = opendir(dir);
+
+        while ( dirent* de = readdir(d) )
+        {
+            if ( de->d_name[0] != '.' )
+                file = std::string(dir) + "/" + de->d_name;
+        }
+        closedir(d);
+        return file;
+    }
+};
+
+TEST(ktrie_image, round_trip)
+{
+    const char* text = "xxabcabdhelpxyzwhelloqwaqwz";
+
+    KTRIE_STRUCT* ks = test_compile(pats, &config);
+    CHECK(!ks->image_loaded);
+    CHECK(ks->fdenses == 1);
+    CHECK(!image().empty());
+
+    std::vector<unsigned> expect = test_search(ks, std::string(text));
+    CHECK(expect == test_naive(pats, text));
+
+    KTRIE_STRUCT* loaded = test_compile(pats, &config);
+    CHECK(loaded->image_loaded);
+    CHECK(loaded->fdenses == 1);
+    CHECK(test_search(loaded, std::string(text)) == expect);
+
+    KTrieDelete(loaded);
+    KTrieDelete(ks);
+}
+
+// a partial image is not used and the trie is compiled again
+TEST(ktrie_image, truncated)
+{
+    const char* text = "xxabcabdhelpxyzwhelloqwaqwz";
+
+    KTRIE_STRUCT* ks = test_compile(pats, &config);
+    std::vector<unsigned> expect = test_search(ks, std::string(text));
+    KTrieDelete(ks);
+
+    std::string file = image();
+    CHECK(truncate(file.c_str(), 100) == 0);
+
+    ks = test_compile(pats, &config);
+    CHECK(!ks->image_loaded);
+    CHECK(test_search(ks, std::string(text)) == expect);
+    KTrieDelete(ks);
+
+    // and saved again
+    ks = test_compile(pats, &config);
+    CHECK(ks->image_loaded);
+    CHECK(test_search(ks, std::string(text)) == expect);
+    KTrieDelete(ks);
+}
+
+//--------------------------------------------------------------------------
+
+TEST_GROUP(ktrie_threads)
+{
+    void setup() override
+    {
+        KTrie_init_xlatcase();
+        s_live_trees = 0;
+    }
+
+    void teardown() override
+    { CHECK(s_live_trees == 0); }
+};
+
+// patterns inserted by several threads must give the same trie and
+// build the match states in the same order as a serial compile
+TEST(ktrie_threads, same_as_serial)
+{
+    const char* alpha = "abcdeF";
+    unsigned seed = 7;
+    std::vector<std::string> pats;
+
+    for ( unsigned i = 0; i < 3000; i++ )
+    {
+        std::string p;
+
+        seed = seed * 1103515245 + 12345;
+        unsigned n = 2 + (seed >> 16) % 7;
+
+        for ( unsigned k = 0; k < n; k++ )
+        {
+            seed = seed * 1103515245 + 12345;
+            p += alpha[(seed >> 16) % 6];
+        }
+        pats.push_back(p);
+    }
+
+    std::string text;
+
+    for ( unsigned i = 0; i < 2000; i++ )
+    {
+        seed = seed * 1103515245 + 12345;
+        text += alpha[(seed >> 16) % 6];
+    }
+
+    KTRIE_CONFIG config = { };
+    KTRIE_STRUCT* ks[2];
+    std::vector<unsigned> order[2];
+
+    for ( unsigned t = 0; t < 2; t++ )
+    {
+        config.compile_threads = t ? 4 : 1;
+        ks[t] = KTrieNew(KTRIE_METHOD_AUTO, &s_tree_agent, &config);
+
+        // every 3rd pattern is nocase so both tries are built
+        for ( unsigned i = 0; i < pats.size(); i++ )
+        {
+            KTrieAddPattern(ks[t], (const uint8_t*)pats[i].data(), pats[i].size(),
+                i % 3 == 0, false, (void*)(uintptr_t)(i + 1));
+        }
+        s_build_order.clear();
+        KTrieCompile(nullptr, ks[t]);
+        order[t] = s_build_order;
+    }
+
+    CHECK(!order[0].empty() and order[0] == order[1]);
+    CHECK(ks[0]->fnodes == ks[1]->fnodes);
+    CHECK(!memcmp(ks[0]->fnode, ks[1]->fnode, ks[0]->fnodes * sizeof(KTRIEFNODE)));
+
+    std::vector<std::string> found = tree_search(ks[0], text.c_str());
+    CHECK(!found.empty() and found == tree_search(ks[1], text.c_str()));
+
+    KTrieDelete(ks[0]);
+    KTrieDelete(ks[1]);
+}
+
+//--------------------------------------------------------------------------
+
+TEST_GROUP(ktrie_stream)
+{
+    void setup() override
+    { KTrie_init_xlatcase(); }
+};
+
+// the caller keeps the state between buffers
+TEST(ktrie_stream, split)
+{
+    KTRIE_STRUCT* ks = test_compile({ "abcd", "xy" });
+    KTRIE_STREAM st = { };
+    std::vector<unsigned> found;
+
+    KTrieSearchStream(ks, &st, (const uint8_t*)"xxab", 4, test_match, &found);
+    CHECK(found.empty());
+    CHECK(st.nactive == 1);
+
+    KTrieSearchStream(ks, &st, (const uint8_t*)"cdxy", 4, test_match, &found);
+    CHECK(found.size() == 2 and found[0] == 0 and found[1] == 1);
+
+    // a fresh state starts over
+    KTRIE_STREAM fresh = { };
+    found.clear();
+
+    KTrieSearchStream(ks, &fresh, (const uint8_t*)"cdxy", 4, test_match, &found);
+    CHECK(found.size() == 1 and found[0] == 1);
+
+    KTrieDelete(ks);
+}
+
+//--------------------------------------------------------------------------
+
+TEST_GROUP(ktrie_share)
+{
+    void setup() override
+    { KTrie_init_xlatcase(); }
+};
+
+// only tries with the same patterns use one image
+TEST(ktrie_share, same_patterns)
+{
+    KTRIE_MEMSTATS before;
+    KTrieGetMemStats(&before);
+
+    KTRIE_STRUCT* a = test_compile_shared({ "abc", "xyz" });
+    KTRIE_STRUCT* b = test_compile_shared({ "abc", "xyz" });
+    KTRIE_STRUCT* c = test_compile_shared({ "abc", "xyw" });
+
+    KTRIE_MEMSTATS ms;
+    KTrieGetMemStats(&ms);
+    CHECK(ms.shared == before.shared + 1);
+
+    CHECK(a->image and a->image == b->image);
+    CHECK(c->image != a->image);
+
+    std::vector<unsigned> found = test_search(c, "xyz");
+    CHECK(found.empty());
+
+    found = test_search(b, "xyz");
+    CHECK(found.size() == 1 and found[0] == 1);
+
+    KTrieDelete(a);
+    KTrieDelete(b);
+    KTrieDelete(c);
+
+    KTrieGetMemStats(&ms);
+    CHECK(ms.shared == before.shared);
+    CHECK(ms.bytes == before.bytes);
+}
+
+//--------------------------------------------------------------------------
+
+TEST_GROUP(ktrie_totals)
+{
+    void setup() override
+    { KTrie_init_xlatcase(); }
+};
+
+// the totals follow the live tries, so deleting the tries of an older
+// configuration leaves those of a newer one counted
+TEST(ktrie_totals, live)
+{
+    KTRIE_MEMSTATS before;
+    KTrieGetMemStats(&before);
+
+    KTRIE_STRUCT* old_ks = test_compile({ "abc", "abd" });
+    KTRIE_STRUCT* new_ks = test_compile({ "xyz" });
+
+    KTRIE_MEMSTATS both;
+    KTrieGetMemStats(&both);
+    CHECK(both.tries == before.tries + 2);
+    CHECK(both.patterns == before.patterns + 3);
+
+    KTrieDelete(old_ks);
+
+    KTRIE_MEMSTATS after;
+    KTrieGetMemStats(&after);
+    CHECK(after.tries == before.tries + 1);
+    CHECK(after.patterns == before.patterns + 1);
+    CHECK(after.bytes > before.bytes and after.bytes < both.bytes);
+
+    KTrieDelete(new_ks);
+
+    KTrieGetMemStats(&after);
+    CHECK(after.tries == before.tries);
+    CHECK(after.patterns == before.patterns);
+    CHECK(after.bytes == before.bytes);
+}
+
+//--------------------------------------------------------------------------
+
+TEST_GROUP(ktrie_update)
+{
+    KTRIE_CONFIG config = { };
+    KTRIE_STRUCT* ks = nullptr;
+    KTRIE_STRUCT* fresh = nullptr;
+
+    void setup() override
+    {
+        KTrie_init_xlatcase();
+        config.compile_threads = 1;
+        config.incremental = true;
+        s_live_trees = 0;
+    }
+
+    void teardown() override
+    {
+        KTrieDelete(ks);
+        KTrieDelete(fresh);
+        CHECK(s_live_trees == 0);
+    }
+
+    KTRIE_STRUCT* make()
+    { return KTrieNew(KTRIE_METHOD_AUTO, &s_tree_agent, &config); }
+
+    // the updated trie must find what a fresh compile of its patterns does
+    void check_same(const std::vector<const char*>& texts)
+    {
+        CHECK(KTriePatternCount(ks) == KTriePatternCount(fresh));
+        CHECK(ks->bcSize == fresh->bcSize);
+        CHECK(!memcmp(ks->bcShift, fresh->bcShift, sizeof(ks->bcShift)));
+
+        for ( const char* t : texts )
+            CHECK(tree_search(ks, t) == tree_search(fresh, t));
+    }
+};
+
+// a pattern added and removed between updates was never inserted
+TEST(ktrie_update, remove_pending)
+{
+    ks = make();
+    tree_add(ks, "abcd", 1);
+    tree_add(ks, "bcde", 2);
+    KTrieCompile(nullptr, ks);
+
+    tree_add(ks, "cdef", 3);
+    tree_add(ks, "wxyz", 4);
+    tree_remove(ks, "cdef", 3);
+    CHECK(KTrieUpdate(nullptr, ks) == 0);
+
+    fresh = make();
+    tree_add(fresh, "abcd", 1);
+    tree_add(fresh, "bcde", 2);
+    tree_add(fresh, "wxyz", 4);
+    KTrieCompile(nullptr, fresh);
+
+    check_same({ "abcdef", "cdef", "xxwxyzxx" });
+    CHECK(tree_search(ks, "cdef").empty());
+}
+
+// a pattern shorter than bcSize needs new shifts, not just lower ones
+TEST(ktrie_update, shorter_pattern)
+{
+    ks = make();
+    tree_add(ks, "abcdef", 1);
+    tree_add(ks, "uvwxyz", 2);
+    KTrieCompile(nullptr, ks);
+    CHECK(ks->bcSize == 6);
+
+    tree_add(ks, "qr", 3);
+    CHECK(KTrieUpdate(nullptr, ks) == 0);
+    CHECK(ks->bcSize == 2);
+
+    fresh = make();
+    tree_add(fresh, "abcdef", 1);
+    tree_add(fresh, "uvwxyz", 2);
+    tree_add(fresh, "qr", 3);
+    KTrieCompile(nullptr, fresh);
+
+    check_same({ "..........qr....", "qrabcdefqr", "xuvwxyzqr" });
+
+    std::vector<std::string> found = tree_search(ks, "..........qr....");
+    CHECK(found.size() == 1 and found[0] == "12: 3");
+}
+
+// removing one of several patterns ending at a node rebuilds the match
+// state of that node from the others
+TEST(ktrie_update, shared_state)
+{
+    ks = make();
+    tree_add(ks, "abc", 1);
+    tree_add(ks, "abc", 2);
+    tree_add(ks, "abc", 3);
+    tree_add(ks, "xyz", 4);
+    KTrieCompile(nullptr, ks);
+    CHECK(s_live_trees == 2);
+
+    std::vector<std::string> found = tree_search(ks, "abc");
+    CHECK(found.size() == 1 and found[0] == "3: 1 2 3");
+
+    tree_remove(ks, "abc", 2);
+
+    s_build_calls = 0;
+    CHECK(KTrieUpdate(nullptr, ks) == 0);
+
+    // just the 2 left at the node and the finishing call
+    CHECK(s_build_calls == 3);
+    CHECK(s_live_trees == 2);
+
+    fresh = make();
+    tree_add(fresh, "abc", 1);
+    tree_add(fresh, "abc", 3);
+    tree_add(fresh, "xyz", 4);
+    KTrieCompile(nullptr, fresh);
+
+    check_same({ "abc", "xxabcxyz" });
+
+    found = tree_search(ks, "abc");
+    CHECK(found.size() == 1 and found[0] == "3: 1 3");
+}
+
+//--------------------------------------------------------------------------
+
+int main(int argc, char** argv)
+{
+    return CommandLineTestRunner::RunAllTests(argc, argv);
+}